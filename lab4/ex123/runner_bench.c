@@ -0,0 +1,837 @@
+/**
+ * This runner benchmarks the shared heap.
+ *
+ * live: measures the latency of shmheap_alloc while the heap holds
+ *       10, 100, ..., `max_live_objects` live objects, and reports how
+ *       fragmented the free space is afterwards.
+ * slab: measures the throughput of `num_proc` processes allocating and
+ *       freeing fixed-size objects with shmheap_alloc and with a slab.
+ * regions: measures the throughput of `num_proc` processes allocating and
+ *       freeing objects too large for the thread cache, in a heap with one
+ *       region and in a heap with a region per process.
+ * policy: replays the same synthetic trace of mixed-size allocations and
+ *       frees under every allocation policy and reports the throughput and
+ *       the peak fragmentation of each.
+ * classes: frees `num_blocks` blocks of different sizes that all fall in one
+ *       size class, kept apart so they cannot merge, and allocates them
+ *       again, under the segregated and the good-fit policy.
+ * queue: streams `num_messages` object handles from one process to another
+ *       over a pipe and over a shmheap_queue, and reports the cost per message.
+ * tlb:  measures random accesses to a heap of `heap_mb` megabytes backed by
+ *       regular, transparent huge and hugetlbfs pages, with dTLB misses
+ *       where perf events are available.
+ * record: has `num_proc` processes run the trace of the policy benchmark
+ *       against one heap with tracing on, and dumps the trace to `trace_file`.
+ * replay: replays the calls in `trace_file`, recorded by `record` or by any
+ *       program through shmheap_trace_dump, in order in a fresh heap and
+ *       reports latency percentiles of shmheap_alloc and shmheap_free and
+ *       the fragmentation of the heap over time.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmheap.h"
+
+static char shm_name_store[20]="/shmheap";
+
+static const char *find_good_shm_name() {
+    for (int i=0; true; ++i){
+        sprintf(shm_name_store+8, "%d", i);
+        int fd;
+        if ((fd = shm_open(shm_name_store, O_RDWR, 0)) == -1) {
+            if (errno == ENOENT) return shm_name_store;
+            else if (errno == EINVAL || errno == EMFILE || errno == ENAMETOOLONG || errno == ENFILE) {
+                printf("Unexpected error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else {
+            close(fd);
+        }
+    }
+}
+
+static double now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+// rounds len up to a multiple of the page size, with room for the heap header
+static size_t heap_size_for(size_t len) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    return (len + (1 << 16) + page_size - 1) / page_size * page_size;
+}
+
+#define OBJECT_SIZE 32
+// too large for the thread cache, so that the size classes are measured
+#define LIVE_OBJECT_SIZE (SHMHEAP_CACHE_MAX_SIZE + 32)
+#define BATCH_SIZE 1000
+#define NUM_BATCHES 100
+
+static int bench_live(size_t max_live) {
+    printf("%12s %16s %12s %14s\n", "live objects", "ns per alloc", "free bytes", "fragmentation");
+    for (size_t num_live = 10; num_live <= max_live; num_live *= 10) {
+        const char *const mem_name = find_good_shm_name();
+        shmheap_memory_handle mem = shmheap_create(mem_name, heap_size_for((num_live + BATCH_SIZE) * (LIVE_OBJECT_SIZE + 64)));
+
+        void **objects = malloc(sizeof(void *) * num_live);
+        assert(objects != NULL);
+        for (size_t i=0; i!=num_live; ++i) {
+            objects[i] = shmheap_alloc(mem, LIVE_OBJECT_SIZE);
+            assert(objects[i] != NULL);
+        }
+
+        // free a batch of random objects (untimed), then time the allocations
+        // that replace them, so the number of live objects stays the same
+        size_t batch = num_live < BATCH_SIZE ? num_live : BATCH_SIZE;
+        size_t *victims = malloc(sizeof(size_t) * batch);
+        assert(victims != NULL);
+        double elapsed = 0;
+        for (int round=0; round!=NUM_BATCHES; ++round) {
+            for (size_t i=0; i!=batch; ++i) {
+                size_t idx = (size_t) rand() % num_live;
+                if (objects[idx] != NULL) {
+                    shmheap_free(mem, objects[idx]);
+                    objects[idx] = NULL;
+                }
+                victims[i] = idx;
+            }
+            const double start = now_ns();
+            for (size_t i=0; i!=batch; ++i) {
+                if (objects[victims[i]] == NULL) {
+                    objects[victims[i]] = shmheap_alloc(mem, LIVE_OBJECT_SIZE);
+                }
+            }
+            elapsed += now_ns() - start;
+            for (size_t i=0; i!=batch; ++i) {
+                assert(objects[victims[i]] != NULL);
+            }
+        }
+        // fragmentation: share of the free bytes outside the largest free block
+        shmheap_heap_stats stats;
+        shmheap_stats(mem, &stats);
+        double fragmentation = stats.free_bytes == 0 ? 0 : 1 - (double) stats.largest_free_block / stats.free_bytes;
+        printf("%12zu %16.1f %12zu %14.3f\n", num_live, elapsed / (NUM_BATCHES * batch), stats.free_bytes, fragmentation);
+
+        free(victims);
+        free(objects);
+        shmheap_destroy(mem_name, mem);
+    }
+    return EXIT_SUCCESS;
+}
+
+#define WORKING_SET 64
+#define OPS_PER_PROC 1000000
+
+// allocates and frees objects, keeping WORKING_SET of them live
+static int procs_child(const char *mem_name, shmheap_object_handle slab_hdl, int use_slab, int child_idx) {
+    shmheap_memory_handle mem = shmheap_connect(mem_name);
+    shmheap_slab *slab = shmheap_handle_to_ptr(mem, slab_hdl);
+    void *objects[WORKING_SET] = {NULL};
+    srand(child_idx);
+
+    for (int i=0; i!=OPS_PER_PROC; ++i) {
+        int idx = rand() % WORKING_SET;
+        if (objects[idx] != NULL) {
+            if (use_slab) shmheap_slab_free(mem, slab, objects[idx]);
+            else shmheap_free(mem, objects[idx]);
+        }
+        objects[idx] = use_slab ? shmheap_slab_alloc(mem, slab) : shmheap_alloc(mem, OBJECT_SIZE);
+        if (objects[idx] == NULL) {
+            return EXIT_FAILURE;
+        }
+        *(int *) objects[idx] = i;
+    }
+    for (int idx=0; idx!=WORKING_SET; ++idx) {
+        if (objects[idx] != NULL) {
+            if (use_slab) shmheap_slab_free(mem, slab, objects[idx]);
+            else shmheap_free(mem, objects[idx]);
+        }
+    }
+
+    shmheap_disconnect(mem);
+    return EXIT_SUCCESS;
+}
+
+static int bench_procs(int num_proc) {
+    assert(num_proc > 0);
+    printf("%10s %16s %16s\n", "processes", "alloc Mops/s", "slab Mops/s");
+    for (int n=1; n<=num_proc; n*=2) {
+        double mops[2];
+        for (int use_slab=0; use_slab!=2; ++use_slab) {
+            const char *const mem_name = find_good_shm_name();
+            shmheap_memory_handle mem = shmheap_create(mem_name, heap_size_for((size_t) n * (1 << 20)));
+            shmheap_slab *slab = shmheap_slab_create(mem, OBJECT_SIZE);
+            assert(slab != NULL);
+            shmheap_object_handle slab_hdl = shmheap_ptr_to_handle(mem, slab);
+
+            fflush(stdout);
+            const double start = now_ns();
+            for (int i=0; i!=n; ++i) {
+                int res = fork();
+                assert(res != -1);
+                if (res == 0) {
+                    exit(procs_child(mem_name, slab_hdl, use_slab, i));
+                }
+            }
+            for (int i=0; i!=n; ++i) {
+                int status;
+                if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                    printf("Child terminated abruptly!\n");
+                }
+            }
+            mops[use_slab] = (double) n * OPS_PER_PROC * 1e3 / (now_ns() - start);
+
+            shmheap_slab_destroy(mem, slab);
+            shmheap_destroy(mem_name, mem);
+        }
+        printf("%10d %16.2f %16.2f\n", n, mops[0], mops[1]);
+    }
+    return EXIT_SUCCESS;
+}
+
+#define REGION_OPS_PER_PROC 200000
+
+// allocates and frees objects of mixed sizes above the size that the
+// thread cache serves, keeping WORKING_SET of them live
+static int regions_child(const char *mem_name, int child_idx) {
+    shmheap_memory_handle mem = shmheap_connect(mem_name);
+    void *objects[WORKING_SET] = {NULL};
+    srand(child_idx);
+
+    for (int i=0; i!=REGION_OPS_PER_PROC; ++i) {
+        int idx = rand() % WORKING_SET;
+        if (objects[idx] != NULL) {
+            shmheap_free(mem, objects[idx]);
+        }
+        objects[idx] = shmheap_alloc(mem, SHMHEAP_CACHE_MAX_SIZE + 8 + rand() % 4096);
+        if (objects[idx] == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
+    for (int idx=0; idx!=WORKING_SET; ++idx) {
+        if (objects[idx] != NULL) {
+            shmheap_free(mem, objects[idx]);
+        }
+    }
+
+    shmheap_disconnect(mem);
+    return EXIT_SUCCESS;
+}
+
+static int bench_regions(int num_proc) {
+    assert(num_proc > 0);
+    printf("%10s %16s %16s\n", "processes", "1 region Mops/s", "n regions Mops/s");
+    for (int n=1; n<=num_proc; n*=2) {
+        double mops[2];
+        for (int per_proc=0; per_proc!=2; ++per_proc) {
+            const char *const mem_name = find_good_shm_name();
+            shmheap_options options = {0};
+            options.num_regions = per_proc ? n : 1;
+            shmheap_memory_handle mem = shmheap_create_with_options(mem_name, (size_t) n * (1 << 20), &options);
+
+            fflush(stdout);
+            const double start = now_ns();
+            for (int i=0; i!=n; ++i) {
+                int res = fork();
+                assert(res != -1);
+                if (res == 0) {
+                    exit(regions_child(mem_name, i));
+                }
+            }
+            for (int i=0; i!=n; ++i) {
+                int status;
+                if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                    printf("Child terminated abruptly!\n");
+                }
+            }
+            mops[per_proc] = (double) n * REGION_OPS_PER_PROC * 1e3 / (now_ns() - start);
+
+            shmheap_destroy(mem_name, mem);
+        }
+        printf("%10d %16.2f %16.2f\n", n, mops[0], mops[1]);
+    }
+    return EXIT_SUCCESS;
+}
+
+#define TRACE_MIN_SIZE (SHMHEAP_CACHE_MAX_SIZE + 8)
+#define TRACE_SIZE_DOUBLINGS 8
+#define TRACE_MAX_LIVE 4000
+#define TRACE_PHASE 20000
+#define TRACE_SAMPLE 1000
+
+// one step of a trace: allocate size bytes into slot, or free slot if size is 0
+typedef struct {
+    int slot;
+    size_t size;
+} trace_op;
+
+// sizes are roughly log-uniform from TRACE_MIN_SIZE up to TRACE_SIZE_DOUBLINGS
+// doublings of it, above the size that the thread cache serves, so every request reaches the policy.
+// The number of live objects swings between a tenth of TRACE_MAX_LIVE and
+// TRACE_MAX_LIVE, which leaves holes behind when it shrinks
+static trace_op *make_trace(size_t num_ops) {
+    trace_op *trace = malloc(sizeof(trace_op) * num_ops);
+    assert(trace != NULL);
+    int *live = malloc(sizeof(int) * TRACE_MAX_LIVE);
+    int *free_slots = malloc(sizeof(int) * TRACE_MAX_LIVE);
+    assert(live != NULL && free_slots != NULL);
+    int num_live = 0;
+    int num_free_slots = TRACE_MAX_LIVE;
+    for (int i=0; i!=TRACE_MAX_LIVE; ++i) {
+        free_slots[i] = TRACE_MAX_LIVE - 1 - i;
+    }
+
+    for (size_t i=0; i!=num_ops; ++i) {
+        int growing = (i / TRACE_PHASE) % 2 == 0;
+        int target = growing ? TRACE_MAX_LIVE : TRACE_MAX_LIVE / 10;
+        int alloc = num_live == 0 || (num_live < TRACE_MAX_LIVE && rand() % 4 != 0 && (growing ? num_live < target : rand() % 3 == 0));
+        if (alloc) {
+            int slot = free_slots[--num_free_slots];
+            live[num_live++] = slot;
+            size_t size = (size_t) TRACE_MIN_SIZE << (rand() % TRACE_SIZE_DOUBLINGS);
+            trace[i].slot = slot;
+            trace[i].size = size + (size_t) rand() % size;
+        }
+        else {
+            int idx = rand() % num_live;
+            trace[i].slot = live[idx];
+            trace[i].size = 0;
+            live[idx] = live[--num_live];
+            free_slots[num_free_slots++] = trace[i].slot;
+        }
+    }
+
+    free(free_slots);
+    free(live);
+    return trace;
+}
+
+static const char *policy_name(shmheap_policy policy) {
+    switch (policy) {
+    case SHMHEAP_POLICY_FIRST_FIT: return "first-fit";
+    case SHMHEAP_POLICY_NEXT_FIT: return "next-fit";
+    case SHMHEAP_POLICY_GOOD_FIT: return "good-fit";
+    default: return "segregated";
+    }
+}
+
+static int bench_policy(size_t num_ops) {
+    trace_op *trace = make_trace(num_ops);
+    void **objects = calloc(TRACE_MAX_LIVE, sizeof(void *));
+    assert(objects != NULL);
+
+    printf("%12s %14s %16s %10s\n", "policy", "Mops/s", "peak frag", "failed");
+    const shmheap_policy policies[] = {SHMHEAP_POLICY_SEGREGATED, SHMHEAP_POLICY_FIRST_FIT, SHMHEAP_POLICY_NEXT_FIT, SHMHEAP_POLICY_GOOD_FIT};
+    for (size_t p=0; p!=sizeof(policies) / sizeof(policies[0]); ++p) {
+        const char *const mem_name = find_good_shm_name();
+        shmheap_options options = {0};
+        options.policy = policies[p];
+        shmheap_memory_handle mem = shmheap_create_with_options(mem_name, (size_t) TRACE_MAX_LIVE * (TRACE_MIN_SIZE << TRACE_SIZE_DOUBLINGS) / 4, &options);
+
+        // fragmentation is sampled between timed stretches of the trace
+        double elapsed = 0;
+        double peak_fragmentation = 0;
+        size_t failed = 0;
+        for (size_t start=0; start<num_ops; start+=TRACE_SAMPLE) {
+            size_t end = start + TRACE_SAMPLE < num_ops ? start + TRACE_SAMPLE : num_ops;
+            const double t = now_ns();
+            for (size_t i=start; i!=end; ++i) {
+                if (trace[i].size != 0) {
+                    objects[trace[i].slot] = shmheap_alloc(mem, trace[i].size);
+                    failed += objects[trace[i].slot] == NULL;
+                }
+                else if (objects[trace[i].slot] != NULL) {
+                    shmheap_free(mem, objects[trace[i].slot]);
+                    objects[trace[i].slot] = NULL;
+                }
+            }
+            elapsed += now_ns() - t;
+
+            shmheap_heap_stats stats;
+            shmheap_stats(mem, &stats);
+            double fragmentation = stats.free_bytes == 0 ? 0 : 1 - (double) stats.largest_free_block / stats.free_bytes;
+            if (fragmentation > peak_fragmentation) {
+                peak_fragmentation = fragmentation;
+            }
+        }
+        printf("%12s %14.2f %16.3f %10zu\n", policy_name(policies[p]), num_ops * 1e3 / elapsed, peak_fragmentation, failed);
+
+        for (int i=0; i!=TRACE_MAX_LIVE; ++i) {
+            if (objects[i] != NULL) {
+                shmheap_free(mem, objects[i]);
+                objects[i] = NULL;
+            }
+        }
+        shmheap_destroy(mem_name, mem);
+    }
+
+    free(objects);
+    free(trace);
+    return EXIT_SUCCESS;
+}
+
+// the blocks have capacities in [CLASS_MIN_SIZE, 2 * CLASS_MIN_SIZE), a
+// single size class, and are kept apart by blocks too large for the thread cache
+#define CLASS_MIN_SIZE 4096
+#define SEPARATOR_SIZE (SHMHEAP_CACHE_MAX_SIZE + 8)
+
+static int bench_classes(size_t num_blocks) {
+    void **blocks = malloc(sizeof(void *) * num_blocks);
+    void **separators = malloc(sizeof(void *) * num_blocks);
+    size_t *sizes = malloc(sizeof(size_t) * num_blocks);
+    size_t *order = malloc(sizeof(size_t) * num_blocks);
+    assert(blocks != NULL && separators != NULL && sizes != NULL && order != NULL);
+    for (size_t i=0; i!=num_blocks; ++i) {
+        sizes[i] = CLASS_MIN_SIZE + (size_t) rand() % CLASS_MIN_SIZE;
+        order[i] = i;
+    }
+    for (size_t i=num_blocks; i>1; --i) {
+        size_t j = (size_t) rand() % i;
+        size_t tmp = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = tmp;
+    }
+
+    printf("%12s %14s %14s\n", "policy", "ns per free", "ns per alloc");
+    const shmheap_policy policies[] = {SHMHEAP_POLICY_SEGREGATED, SHMHEAP_POLICY_GOOD_FIT};
+    for (size_t p=0; p!=sizeof(policies) / sizeof(policies[0]); ++p) {
+        const char *const mem_name = find_good_shm_name();
+        shmheap_options options = {0};
+        options.policy = policies[p];
+        shmheap_memory_handle mem = shmheap_create_with_options(mem_name, heap_size_for(num_blocks * (2 * CLASS_MIN_SIZE + SEPARATOR_SIZE + 64)), &options);
+        for (size_t i=0; i!=num_blocks; ++i) {
+            blocks[i] = shmheap_alloc(mem, sizes[i]);
+            separators[i] = shmheap_alloc(mem, SEPARATOR_SIZE);
+            assert(blocks[i] != NULL && separators[i] != NULL);
+        }
+
+        double start = now_ns();
+        for (size_t i=0; i!=num_blocks; ++i) {
+            shmheap_free(mem, blocks[order[i]]);
+        }
+        const double free_elapsed = now_ns() - start;
+
+        start = now_ns();
+        for (size_t i=0; i!=num_blocks; ++i) {
+            blocks[i] = shmheap_alloc(mem, sizes[i]);
+            assert(blocks[i] != NULL);
+        }
+        const double alloc_elapsed = now_ns() - start;
+        printf("%12s %14.1f %14.1f\n", policy_name(policies[p]), free_elapsed / num_blocks, alloc_elapsed / num_blocks);
+
+        shmheap_destroy(mem_name, mem);
+    }
+
+    free(order);
+    free(sizes);
+    free(separators);
+    free(blocks);
+    return EXIT_SUCCESS;
+}
+
+#define QUEUE_CAPACITY 1024
+
+// receives num_messages handles and checks that they arrive in order
+static int queue_child(const char *mem_name, shmheap_object_handle queue_hdl, int input_fd, size_t num_messages) {
+    shmheap_memory_handle mem = shmheap_connect(mem_name);
+    shmheap_queue *queue = input_fd == -1 ? shmheap_handle_to_ptr(mem, queue_hdl) : NULL;
+
+    int res = EXIT_SUCCESS;
+    for (size_t i=0; i!=num_messages; ++i) {
+        shmheap_object_handle hdl;
+        if (queue != NULL) {
+            shmheap_queue_pop(mem, queue, &hdl);
+        }
+        else if (read(input_fd, &hdl, sizeof(hdl)) != sizeof(hdl)) {
+            res = EXIT_FAILURE;
+            break;
+        }
+        if (hdl.offset != i * 8) {
+            res = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    shmheap_disconnect(mem);
+    return res;
+}
+
+static int bench_queue(size_t num_messages) {
+    printf("%10s %16s\n", "transport", "ns per message");
+    for (int use_queue=0; use_queue!=2; ++use_queue) {
+        const char *const mem_name = find_good_shm_name();
+        shmheap_memory_handle mem = shmheap_create(mem_name, 1 << 20);
+        shmheap_queue *queue = shmheap_queue_create(mem, QUEUE_CAPACITY);
+        assert(queue != NULL);
+        shmheap_object_handle queue_hdl = shmheap_ptr_to_handle(mem, queue);
+        int fd[2];
+        assert(pipe(fd) == 0);
+
+        fflush(stdout);
+        const double start = now_ns();
+        int res = fork();
+        assert(res != -1);
+        if (res == 0) {
+            close(fd[1]);
+            exit(queue_child(mem_name, queue_hdl, use_queue ? -1 : fd[0], num_messages));
+        }
+        close(fd[0]);
+
+        // the offsets are made up, the consumer only checks their order
+        shmheap_object_handle hdl = {.name = (char *) mem_name};
+        for (size_t i=0; i!=num_messages; ++i) {
+            hdl.offset = i * 8;
+            if (use_queue) {
+                shmheap_queue_push(queue, hdl);
+            }
+            else {
+                assert(write(fd[1], &hdl, sizeof(hdl)) == sizeof(hdl));
+            }
+        }
+        close(fd[1]);
+        int status;
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            printf("Child terminated abruptly!\n");
+        }
+        printf("%10s %16.1f\n", use_queue ? "queue" : "pipe", (now_ns() - start) / num_messages);
+
+        shmheap_queue_destroy(mem, queue);
+        shmheap_destroy(mem_name, mem);
+    }
+    return EXIT_SUCCESS;
+}
+
+#define TLB_ACCESSES 10000000
+
+static const char *page_mode_name(shmheap_page_mode page_mode) {
+    switch (page_mode) {
+    case SHMHEAP_PAGES_TRANSPARENT_HUGE: return "thp";
+    case SHMHEAP_PAGES_HUGETLB: return "hugetlb";
+    default: return "default";
+    }
+}
+
+// opens a counter of dTLB read misses of this process, -1 if unavailable
+static int open_dtlb_counter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// allocates the whole heap in objects, then reads and writes random ones
+static int tlb_child(size_t heap_len, shmheap_page_mode page_mode) {
+    const char *const mem_name = find_good_shm_name();
+    shmheap_options options = {0};
+    options.page_mode = page_mode;
+    shmheap_memory_handle mem = shmheap_create_with_options(mem_name, heap_len, &options);
+
+    size_t max_objects = heap_len / (OBJECT_SIZE + 32);
+    long **objects = malloc(sizeof(long *) * max_objects);
+    assert(objects != NULL);
+    size_t num_objects = 0;
+    while (num_objects != max_objects && (objects[num_objects] = shmheap_alloc(mem, OBJECT_SIZE)) != NULL) {
+        *objects[num_objects++] = 0;
+    }
+
+    // pick the objects up front so the loop only touches the heap
+    size_t *order = malloc(sizeof(size_t) * TLB_ACCESSES);
+    assert(order != NULL);
+    for (size_t i=0; i!=TLB_ACCESSES; ++i) {
+        order[i] = ((size_t) rand() * RAND_MAX + rand()) % num_objects;
+    }
+
+    int counter = open_dtlb_counter();
+    if (counter != -1) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    const double start = now_ns();
+    for (size_t i=0; i!=TLB_ACCESSES; ++i) {
+        ++*objects[order[i]];
+    }
+    const double elapsed = now_ns() - start;
+    long long misses = -1;
+    if (counter != -1) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = -1;
+        }
+        close(counter);
+    }
+
+    printf("%10s %14.2f ", page_mode_name(page_mode), TLB_ACCESSES * 1e3 / elapsed);
+    if (misses >= 0) {
+        printf("%16.4f\n", (double) misses / TLB_ACCESSES);
+    }
+    else {
+        printf("%16s\n", "n/a");
+    }
+
+    free(order);
+    free(objects);
+    shmheap_destroy(mem_name, mem);
+    return EXIT_SUCCESS;
+}
+
+static int bench_tlb(size_t heap_mb) {
+    printf("%10s %14s %16s\n", "pages", "Maccesses/s", "dTLB miss/access");
+    const shmheap_page_mode page_modes[] = {SHMHEAP_PAGES_DEFAULT, SHMHEAP_PAGES_TRANSPARENT_HUGE, SHMHEAP_PAGES_HUGETLB};
+    for (size_t i=0; i!=sizeof(page_modes) / sizeof(page_modes[0]); ++i) {
+        // a page mode the system does not support makes shmheap exit, so
+        // each one runs in its own process
+        fflush(stdout);
+        int res = fork();
+        assert(res != -1);
+        if (res == 0) {
+            exit(tlb_child(heap_mb << 20, page_modes[i]));
+        }
+        int status;
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            printf("%10s %14s %16s\n", page_mode_name(page_modes[i]), "unsupported", "");
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+#define RECORD_OPS_PER_PROC 100000
+
+// runs its own trace of the policy benchmark against the traced heap
+static int record_child(const char *mem_name, int child_idx) {
+    shmheap_memory_handle mem = shmheap_connect(mem_name);
+    srand(child_idx);
+    trace_op *trace = make_trace(RECORD_OPS_PER_PROC);
+    void **objects = calloc(TRACE_MAX_LIVE, sizeof(void *));
+    assert(objects != NULL);
+
+    for (size_t i=0; i!=RECORD_OPS_PER_PROC; ++i) {
+        if (trace[i].size != 0) {
+            objects[trace[i].slot] = shmheap_alloc(mem, trace[i].size);
+        }
+        else if (objects[trace[i].slot] != NULL) {
+            shmheap_free(mem, objects[trace[i].slot]);
+            objects[trace[i].slot] = NULL;
+        }
+    }
+    for (int i=0; i!=TRACE_MAX_LIVE; ++i) {
+        if (objects[i] != NULL) {
+            shmheap_free(mem, objects[i]);
+        }
+    }
+
+    free(objects);
+    free(trace);
+    shmheap_disconnect(mem);
+    return EXIT_SUCCESS;
+}
+
+static int bench_record(const char *trace_file, int num_proc) {
+    assert(num_proc > 0);
+    const char *const mem_name = find_good_shm_name();
+    shmheap_memory_handle mem = shmheap_create(mem_name, (size_t) num_proc * TRACE_MAX_LIVE * (TRACE_MIN_SIZE << TRACE_SIZE_DOUBLINGS) / 4);
+    if (shmheap_trace_start(mem, (size_t) num_proc * RECORD_OPS_PER_PROC * 2) != 0) {
+        printf("Heap is too small for the trace!\n");
+        shmheap_destroy(mem_name, mem);
+        return EXIT_FAILURE;
+    }
+
+    fflush(stdout);
+    const double start = now_ns();
+    for (int i=0; i!=num_proc; ++i) {
+        int res = fork();
+        assert(res != -1);
+        if (res == 0) {
+            exit(record_child(mem_name, i));
+        }
+    }
+    int retval = EXIT_SUCCESS;
+    for (int i=0; i!=num_proc; ++i) {
+        int status;
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            printf("Child terminated abruptly!\n");
+            retval = EXIT_FAILURE;
+        }
+    }
+    const double elapsed = now_ns() - start;
+
+    FILE *out = fopen(trace_file, "wb");
+    if (out == NULL) {
+        perror("fopen failed\n");
+        exit(1);
+    }
+    size_t num_records = shmheap_trace_dump(mem, out);
+    fclose(out);
+    printf("%zu calls from %d processes in %.1f ms written to %s\n", num_records, num_proc, elapsed / 1e6, trace_file);
+
+    shmheap_trace_stop(mem);
+    shmheap_destroy(mem_name, mem);
+    return retval;
+}
+
+#define REPLAY_SAMPLES 10
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void print_percentiles(const char *name, double *latencies, size_t n) {
+    if (n == 0) {
+        printf("%8s %10s\n", name, "-");
+        return;
+    }
+    qsort(latencies, n, sizeof(double), compare_doubles);
+    printf("%8s %10zu %10.0f %10.0f %10.0f %10.0f %10.0f\n", name, n, latencies[n / 2], latencies[n * 9 / 10],
+        latencies[n * 99 / 100], latencies[n * 999 / 1000], latencies[n - 1]);
+}
+
+static int bench_replay(const char *trace_file) {
+    // (1) read the whole trace
+    FILE *in = fopen(trace_file, "rb");
+    if (in == NULL) {
+        perror("fopen failed\n");
+        exit(1);
+    }
+    fseek(in, 0, SEEK_END);
+    size_t num_records = ftell(in) / sizeof(shmheap_trace_record);
+    fseek(in, 0, SEEK_SET);
+    shmheap_trace_record *records = malloc(sizeof(shmheap_trace_record) * (num_records + 1));
+    assert(records != NULL);
+    if (fread(records, sizeof(shmheap_trace_record), num_records, in) != num_records) {
+        perror("fread failed\n");
+        exit(1);
+    }
+    fclose(in);
+
+    // (2) size the heap after the extent of the traced one, and map every
+    // traced position to the object that replaces it
+    size_t extent = 0;
+    for (size_t i=0; i!=num_records; ++i) {
+        if (records[i].op == SHMHEAP_TRACE_ALLOC && records[i].offset + records[i].size > extent) {
+            extent = records[i].offset + records[i].size;
+        }
+    }
+    void **objects = calloc(extent / 8 + 1, sizeof(void *));
+    double *alloc_latencies = malloc(sizeof(double) * (num_records + 1));
+    double *free_latencies = malloc(sizeof(double) * (num_records + 1));
+    assert(objects != NULL && alloc_latencies != NULL && free_latencies != NULL);
+    const char *const mem_name = find_good_shm_name();
+    shmheap_memory_handle mem = shmheap_create(mem_name, heap_size_for(extent));
+
+    // (3) replay the calls one by one, sampling the heap between stretches
+    printf("%12s %12s %16s %14s\n", "calls", "free bytes", "largest free", "fragmentation");
+    size_t num_allocs = 0, num_frees = 0, failed = 0;
+    size_t sample = num_records / REPLAY_SAMPLES + 1;
+    for (size_t i=0; i!=num_records; ++i) {
+        shmheap_trace_record *record = &records[i];
+        // frees past the extent are of objects allocated before the ring
+        // wrapped, which the replay never created
+        int in_extent = record->offset >= 0 && (size_t) record->offset / 8 <= extent / 8;
+        void **object = in_extent ? &objects[record->offset / 8] : NULL;
+        if (object != NULL && record->op == SHMHEAP_TRACE_ALLOC && record->offset != 0) {
+            // the free of the previous object there fell out of the ring
+            if (*object != NULL) {
+                shmheap_free(mem, *object);
+            }
+            const double start = now_ns();
+            *object = shmheap_alloc(mem, record->size);
+            alloc_latencies[num_allocs++] = now_ns() - start;
+            failed += *object == NULL;
+        }
+        else if (object != NULL && record->op == SHMHEAP_TRACE_FREE && *object != NULL) {
+            const double start = now_ns();
+            shmheap_free(mem, *object);
+            free_latencies[num_frees++] = now_ns() - start;
+            *object = NULL;
+        }
+
+        if ((i + 1) % sample == 0 || i + 1 == num_records) {
+            shmheap_heap_stats stats;
+            shmheap_stats(mem, &stats);
+            double fragmentation = stats.free_bytes == 0 ? 0 : 1 - (double) stats.largest_free_block / stats.free_bytes;
+            printf("%12zu %12zu %16zu %14.3f\n", i + 1, stats.free_bytes, stats.largest_free_block, fragmentation);
+        }
+    }
+
+    printf("\n%8s %10s %10s %10s %10s %10s %10s\n", "ns", "calls", "p50", "p90", "p99", "p99.9", "max");
+    print_percentiles("alloc", alloc_latencies, num_allocs);
+    print_percentiles("free", free_latencies, num_frees);
+    if (failed != 0) {
+        printf("%zu allocations failed\n", failed);
+    }
+
+    free(free_latencies);
+    free(alloc_latencies);
+    free(objects);
+    free(records);
+    shmheap_destroy(mem_name, mem);
+    return EXIT_SUCCESS;
+}
+
+int main (int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("usage: %s live [max_live_objects]\n", argv[0]);
+        printf("       %s slab [max_num_proc]\n", argv[0]);
+        printf("       %s regions [max_num_proc]\n", argv[0]);
+        printf("       %s policy [num_ops]\n", argv[0]);
+        printf("       %s classes [num_blocks]\n", argv[0]);
+        printf("       %s queue [num_messages]\n", argv[0]);
+        printf("       %s tlb [heap_mb]\n", argv[0]);
+        printf("       %s record trace_file [num_proc]\n", argv[0]);
+        printf("       %s replay trace_file\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    srand(2106);
+
+    if (strcmp(argv[1], "live") == 0) {
+        return bench_live(argc > 2 ? (size_t) atol(argv[2]) : 1000000);
+    }
+    if (strcmp(argv[1], "slab") == 0) {
+        return bench_procs(argc > 2 ? atoi(argv[2]) : 16);
+    }
+    if (strcmp(argv[1], "regions") == 0) {
+        return bench_regions(argc > 2 ? atoi(argv[2]) : 64);
+    }
+    if (strcmp(argv[1], "policy") == 0) {
+        return bench_policy(argc > 2 ? (size_t) atol(argv[2]) : 200000);
+    }
+    if (strcmp(argv[1], "classes") == 0) {
+        return bench_classes(argc > 2 ? (size_t) atol(argv[2]) : 10000);
+    }
+    if (strcmp(argv[1], "queue") == 0) {
+        return bench_queue(argc > 2 ? (size_t) atol(argv[2]) : 1000000);
+    }
+    if (strcmp(argv[1], "tlb") == 0) {
+        return bench_tlb(argc > 2 ? (size_t) atol(argv[2]) : 256);
+    }
+    if (strcmp(argv[1], "record") == 0 && argc > 2) {
+        return bench_record(argv[2], argc > 3 ? atoi(argv[3]) : 2);
+    }
+    if (strcmp(argv[1], "replay") == 0 && argc > 2) {
+        return bench_replay(argv[2]);
+    }
+    printf("unknown benchmark: %s\n", argv[1]);
+    return EXIT_FAILURE;
+}
@@ -2,6 +2,28 @@
  * This runner tests ex1 by creating a shared heap,
  * allocating one object in it, and sending it to
  * `num_receiver_processes` other processes via a pipe.
+ *
+ * Run as `runner_ex3 free_stress num_proc num_objects` to instead have
+ * `num_proc` processes each fill the heap with `num_objects` objects and
+ * free them again, reporting the average latency of shmheap_free.
+ *
+ * Run as `runner_ex3 crash num_proc num_rounds` to have `num_proc` processes
+ * allocate and free objects until they are killed, `num_rounds` times over,
+ * checking that the heap is repaired and reporting how long that takes.
+ *
+ * Run as `runner_ex3 containers num_proc num_items` to build a vector, a map
+ * and a list of `num_items` items and have `num_proc` processes, which map the
+ * heap at other addresses, check their contents.
+ *
+ * Run as `runner_ex3 persist path num_items` to have a process fill a map of
+ * `num_items` items in a heap kept in the file at `path` and die without
+ * closing it, and a second process reopen the file and check the map,
+ * reporting how long reopening takes.
+ *
+ * Run as `runner_ex3 hugetlb num_items` to fill an array of `num_items` items
+ * in a heap backed by huge pages in SHMHEAP_HUGETLBFS_DIR and have another
+ * process connect to it and check the array. Skipped when there is no such
+ * mount or it has no free huge pages.
  */
 
 #include <assert.h>
@@ -11,6 +33,8 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
 #include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -153,7 +177,445 @@ typedef struct {
     size_t sz;
 } command_t;
 
-int main () {    
+static double now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int free_stress_child(const char *mem_name, int child_idx, int num_objects) {
+    shmheap_memory_handle mem = shmheap_connect(mem_name);
+    void **objects = malloc(sizeof(void *) * num_objects);
+    assert(objects != NULL);
+    srand(child_idx);
+
+    // (1) free from the back of the heap to the front
+    // (2) free in random order, which merges with either neighbour
+    double elapsed[2] = {0, 0};
+    for (int pass=0; pass!=2; ++pass) {
+        for (int i=0; i!=num_objects; ++i) {
+            // too large for the thread cache, so that every free coalesces
+            objects[i] = shmheap_alloc(mem, (size_t) (SHMHEAP_CACHE_MAX_SIZE + 8 + rand() % 64));
+            assert(objects[i] != NULL);
+        }
+        if (pass == 1) {
+            for (int i=num_objects-1; i>0; --i) {
+                int j = rand() % (i + 1);
+                void *tmp = objects[i];
+                objects[i] = objects[j];
+                objects[j] = tmp;
+            }
+        }
+        const double start = now_ns();
+        for (int i=num_objects-1; i>=0; --i) {
+            shmheap_free(mem, objects[i]);
+        }
+        elapsed[pass] = now_ns() - start;
+    }
+
+    flock(STDOUT_FILENO, LOCK_EX);
+    printf("#%d: ns per free: %.1f (back to front), %.1f (random)\n", child_idx,
+        elapsed[0] / num_objects, elapsed[1] / num_objects);
+    fflush(stdout);
+    flock(STDOUT_FILENO, LOCK_UN);
+
+    free(objects);
+    shmheap_disconnect(mem);
+    return EXIT_SUCCESS;
+}
+
+static int free_stress(int num_proc, int num_objects) {
+    assert(num_proc > 0);
+    assert(num_objects > 0);
+
+    // every process needs room for its objects (at most 72 bytes more than
+    // the thread cache takes each, plus a divider)
+    const long page_size = sysconf(_SC_PAGESIZE);
+    size_t mem_size = (size_t) num_proc * num_objects * (SHMHEAP_CACHE_MAX_SIZE + 96) + (1 << 16);
+    mem_size = (mem_size + page_size - 1) / page_size * page_size;
+
+    const char *const mem_name = find_good_shm_name();
+    shmheap_memory_handle mem = shmheap_create(mem_name, mem_size);
+
+    for (int i=0; i!=num_proc; ++i) {
+        int res = fork();
+        assert(res != -1);
+        if (res == 0) {
+            exit(free_stress_child(mem_name, i, num_objects));
+        }
+    }
+
+    int retval = EXIT_SUCCESS;
+    for (int i=0; i!=num_proc; ++i) {
+        int status;
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            printf("Child terminated abruptly!\n");
+            retval = EXIT_FAILURE;
+        }
+    }
+
+    shmheap_destroy(mem_name, mem);
+    return retval;
+}
+
+// allocates and frees objects that are too large for the thread cache,
+// so the heap lock is taken all the time, until killed
+static void crash_child(const char *mem_name, int child_idx) {
+    shmheap_memory_handle mem = shmheap_connect(mem_name);
+    void *objects[16] = {NULL};
+    srand(child_idx);
+    while (1) {
+        int idx = rand() % 16;
+        if (objects[idx] != NULL) {
+            shmheap_free(mem, objects[idx]);
+        }
+        objects[idx] = shmheap_alloc(mem, SHMHEAP_CACHE_MAX_SIZE + 8 + rand() % 4096);
+    }
+}
+
+static int crash(int num_proc, int num_rounds) {
+    const char *const mem_name = find_good_shm_name();
+    shmheap_memory_handle mem = shmheap_create(mem_name, (size_t) num_proc << 20);
+
+    int retval = EXIT_SUCCESS;
+    double max_recovery = 0;
+    pid_t *pids = malloc(sizeof(pid_t) * num_proc);
+    for (int round=0; round!=num_rounds; ++round) {
+        for (int i=0; i!=num_proc; ++i) {
+            pids[i] = fork();
+            assert(pids[i] != -1);
+            if (pids[i] == 0) {
+                crash_child(mem_name, round * num_proc + i);
+            }
+        }
+
+        // kill the children at some point in the middle of their work
+        usleep(1000 + rand() % 10000);
+        for (int i=0; i!=num_proc; ++i) {
+            kill(pids[i], SIGKILL);
+        }
+        for (int i=0; i!=num_proc; ++i) {
+            waitpid(pids[i], NULL, 0);
+        }
+
+        // the first lock after a child died holding it repairs the heap
+        const double start = now_ns();
+        void *ptr = shmheap_alloc(mem, SHMHEAP_CACHE_MAX_SIZE + 8);
+        const double elapsed = now_ns() - start;
+        if (elapsed > max_recovery) {
+            max_recovery = elapsed;
+        }
+        if (ptr == NULL || shmheap_check(mem, 0) != 0) {
+            printf("Heap is inconsistent after round %d!\n", round);
+            retval = EXIT_FAILURE;
+        }
+        shmheap_free(mem, ptr);
+    }
+    printf("%d rounds, longest recovery %.3f ms\n", num_rounds, max_recovery / 1e6);
+
+    free(pids);
+    shmheap_destroy(mem_name, mem);
+    return retval;
+}
+
+// the containers of the containers mode, found by children through a handle
+typedef struct {
+    shmheap_rel_ptr vec;
+    shmheap_rel_ptr map;
+    shmheap_rel_ptr list;
+} containers_root;
+
+static int containers_child(const char *mem_name, shmheap_object_handle root_hdl, int num_items) {
+    // a fresh connection maps the heap elsewhere, so only relative pointers work
+    shmheap_memory_handle mem = shmheap_connect(mem_name);
+    containers_root *root = shmheap_handle_to_ptr(mem, root_hdl);
+    shmheap_vector *vec = shmheap_rel_to_ptr(mem, root->vec);
+    shmheap_map *map = shmheap_rel_to_ptr(mem, root->map);
+    shmheap_list *list = shmheap_rel_to_ptr(mem, root->list);
+
+    int retval = EXIT_SUCCESS;
+    if (vec->size != (uint32_t) num_items || map->size != (uint32_t) (num_items / 2) ||
+            list->size != (uint32_t) (num_items / 2)) {
+        retval = EXIT_FAILURE;
+    }
+    for (int i=0; i!=num_items; ++i) {
+        if (*(uint64_t *) shmheap_vector_at(mem, vec, i) != (uint64_t) i * i) {
+            retval = EXIT_FAILURE;
+        }
+        uint64_t value;
+        int found = shmheap_map_get(mem, map, i, &value) == 0;
+        if (found != (i % 2 == 1) || (found && value != (uint64_t) i * 3)) {
+            retval = EXIT_FAILURE;
+        }
+    }
+    int expected = 1;
+    for (int *elem = shmheap_list_first(mem, list); elem != NULL; elem = shmheap_list_next(mem, elem)) {
+        if (*elem != expected) {
+            retval = EXIT_FAILURE;
+        }
+        expected += 2;
+    }
+
+    shmheap_disconnect(mem);
+    return retval;
+}
+
+static int containers(int num_proc, int num_items) {
+    assert(num_proc > 0);
+    assert(num_items > 0);
+
+    const char *const mem_name = find_good_shm_name();
+    // the map table and the vector array are reallocated at twice the size while growing
+    shmheap_memory_handle mem = shmheap_create(mem_name, (size_t) num_items * 256 + (1 << 16));
+
+    // fill the containers, then remove the even items from the map and list
+    containers_root *root = shmheap_alloc(mem, sizeof(containers_root));
+    shmheap_vector *vec = shmheap_vector_create(mem, sizeof(uint64_t));
+    shmheap_map *map = shmheap_map_create(mem, 0);
+    shmheap_list *list = shmheap_list_create(mem, sizeof(int));
+    void **elems = malloc(sizeof(void *) * num_items);
+    for (int i=0; i!=num_items; ++i) {
+        uint64_t square = (uint64_t) i * i;
+        if (shmheap_vector_push(mem, vec, &square) != 0 || shmheap_map_put(mem, map, i, (uint64_t) i * 3) != 0 ||
+                (elems[i] = shmheap_list_push_back(mem, list, &i)) == NULL) {
+            printf("Heap is full!\n");
+            free(elems);
+            shmheap_destroy(mem_name, mem);
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i=0; i<num_items; i+=2) {
+        shmheap_map_remove(mem, map, i);
+        shmheap_list_remove(mem, list, elems[i]);
+    }
+    free(elems);
+    root->vec = shmheap_ptr_to_rel(mem, vec);
+    root->map = shmheap_ptr_to_rel(mem, map);
+    root->list = shmheap_ptr_to_rel(mem, list);
+    shmheap_object_handle root_hdl = shmheap_ptr_to_handle(mem, root);
+
+    for (int i=0; i!=num_proc; ++i) {
+        int res = fork();
+        assert(res != -1);
+        if (res == 0) {
+            exit(containers_child(mem_name, root_hdl, num_items));
+        }
+    }
+
+    int retval = EXIT_SUCCESS;
+    for (int i=0; i!=num_proc; ++i) {
+        int status;
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            printf("Containers differ in a child!\n");
+            retval = EXIT_FAILURE;
+        }
+    }
+
+    shmheap_list_destroy(mem, list);
+    shmheap_map_destroy(mem, map);
+    shmheap_vector_destroy(mem, vec);
+    shmheap_free(mem, root);
+    if (shmheap_check(mem, 0) != 0) {
+        printf("Heap is inconsistent!\n");
+        retval = EXIT_FAILURE;
+    }
+    if (retval == EXIT_SUCCESS) {
+        printf("%d processes saw %d items\n", num_proc, num_items);
+    }
+
+    shmheap_destroy(mem_name, mem);
+    return retval;
+}
+
+// fills a map in the heap in the file at path and dies, leaving it as it is
+static void persist_writer(const char *path, int num_items) {
+    shmheap_memory_handle mem = shmheap_open_file(path, (size_t) num_items * 64 + (1 << 16));
+    shmheap_map *map = shmheap_map_create(mem, num_items);
+    if (map == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for (int i=0; i!=num_items; ++i) {
+        if (shmheap_map_put(mem, map, i, (uint64_t) i * 7) != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    shmheap_set_root(mem, map);
+
+    // die holding the lock, the next process has to get past it
+    pthread_mutex_lock(&((shmheap_header *) shmheap_underlying(mem))->regions[0].mutex);
+    kill(getpid(), SIGKILL);
+}
+
+static int persist_reader(const char *path, int num_items) {
+    const double start = now_ns();
+    shmheap_memory_handle mem = shmheap_open_file(path, 0);
+    const double elapsed = now_ns() - start;
+
+    int retval = EXIT_SUCCESS;
+    shmheap_map *map = shmheap_get_root(mem);
+    if (map == NULL || map->size != (uint32_t) num_items) {
+        retval = EXIT_FAILURE;
+    }
+    for (int i=0; retval == EXIT_SUCCESS && i!=num_items; ++i) {
+        uint64_t value;
+        if (shmheap_map_get(mem, map, i, &value) != 0 || value != (uint64_t) i * 7) {
+            retval = EXIT_FAILURE;
+        }
+    }
+    if (shmheap_check(mem, 0) != 0 || shmheap_alloc(mem, 1024) == NULL) {
+        retval = EXIT_FAILURE;
+    }
+    if (retval == EXIT_SUCCESS) {
+        printf("reopened %d items in %.3f ms\n", num_items, elapsed / 1e6);
+    }
+    shmheap_close_file(mem);
+    return retval;
+}
+
+static int persist(const char *path, int num_items) {
+    assert(num_items > 0);
+    unlink(path);
+
+    int retval = EXIT_SUCCESS;
+    int res = fork();
+    assert(res != -1);
+    if (res == 0) {
+        persist_writer(path, num_items);
+    }
+    int status;
+    if (waitpid(res, &status, 0) == -1 || !WIFSIGNALED(status)) {
+        printf("Writer did not get to fill the heap!\n");
+        retval = EXIT_FAILURE;
+    }
+
+    res = fork();
+    assert(res != -1);
+    if (res == 0) {
+        exit(persist_reader(path, num_items));
+    }
+    if (waitpid(res, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        printf("Heap differs after reopening!\n");
+        retval = EXIT_FAILURE;
+    }
+
+    unlink(path);
+    return retval;
+}
+
+// whether a heap can be created in hugetlbfs, going by the free huge pages
+// of the size that shmheap maps them in
+static bool hugetlb_available(void) {
+    if (access(SHMHEAP_HUGETLBFS_DIR, W_OK) != 0) {
+        return false;
+    }
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/kernel/mm/hugepages/hugepages-%dkB/free_hugepages",
+            SHMHEAP_HUGE_PAGE_SIZE >> 10);
+    FILE *file = fopen(path, "r");
+    long free_pages = 0;
+    if (file != NULL) {
+        if (fscanf(file, "%ld", &free_pages) != 1) {
+            free_pages = 0;
+        }
+        fclose(file);
+    }
+    return free_pages >= 2;
+}
+
+static int hugetlb_child(const char *mem_name, int num_items) {
+    shmheap_memory_handle mem = shmheap_connect(mem_name);
+    uint64_t *items = shmheap_get_root(mem);
+    int retval = items == NULL ? EXIT_FAILURE : EXIT_SUCCESS;
+    for (int i=0; retval == EXIT_SUCCESS && i!=num_items; ++i) {
+        if (items[i] != (uint64_t) i * 5) {
+            retval = EXIT_FAILURE;
+        }
+    }
+    if (shmheap_check(mem, 0) != 0) {
+        retval = EXIT_FAILURE;
+    }
+    shmheap_disconnect(mem);
+    return retval;
+}
+
+static int hugetlb(int num_items) {
+    assert(num_items > 0);
+    if (!hugetlb_available()) {
+        printf("no free huge pages in %s, skipped\n", SHMHEAP_HUGETLBFS_DIR);
+        return EXIT_SUCCESS;
+    }
+
+    const char *const mem_name = find_good_shm_name();
+    shmheap_options options = {0};
+    options.page_mode = SHMHEAP_PAGES_HUGETLB;
+    shmheap_memory_handle mem = shmheap_create_with_options(mem_name, SHMHEAP_HUGE_PAGE_SIZE, &options);
+    uint64_t *items = shmheap_alloc(mem, sizeof(uint64_t) * num_items);
+    if (items == NULL) {
+        printf("Heap is full!\n");
+        shmheap_destroy(mem_name, mem);
+        return EXIT_FAILURE;
+    }
+    for (int i=0; i!=num_items; ++i) {
+        items[i] = (uint64_t) i * 5;
+    }
+    shmheap_set_root(mem, items);
+
+    int retval = EXIT_SUCCESS;
+    int res = fork();
+    assert(res != -1);
+    if (res == 0) {
+        exit(hugetlb_child(mem_name, num_items));
+    }
+    int status;
+    if (waitpid(res, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        printf("Heap differs in a child!\n");
+        retval = EXIT_FAILURE;
+    }
+    if (retval == EXIT_SUCCESS) {
+        printf("connected to a hugetlbfs heap of %d items\n", num_items);
+    }
+
+    shmheap_destroy(mem_name, mem);
+    return retval;
+}
+
+int main (int argc, char *argv[]) {    
+    if (argc > 1 && strcmp(argv[1], "hugetlb") == 0) {
+        if (argc < 3) {
+            printf("usage: %s hugetlb num_items\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return hugetlb(atoi(argv[2]));
+    }
+    if (argc > 1 && strcmp(argv[1], "persist") == 0) {
+        if (argc < 4) {
+            printf("usage: %s persist path num_items\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return persist(argv[2], atoi(argv[3]));
+    }
+    if (argc > 1 && strcmp(argv[1], "containers") == 0) {
+        if (argc < 4) {
+            printf("usage: %s containers num_proc num_items\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return containers(atoi(argv[2]), atoi(argv[3]));
+    }
+    if (argc > 1 && strcmp(argv[1], "crash") == 0) {
+        if (argc < 4) {
+            printf("usage: %s crash num_proc num_rounds\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return crash(atoi(argv[2]), atoi(argv[3]));
+    }
+    if (argc > 1 && strcmp(argv[1], "free_stress") == 0) {
+        if (argc < 4) {
+            printf("usage: %s free_stress num_proc num_objects\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return free_stress(atoi(argv[2]), atoi(argv[3]));
+    }
+
     int num_proc, num_objects;
     size_t mem_size;
     scanf("%d%zu%d", &num_proc, &mem_size, &num_objects);
@@ -10,15 +10,111 @@
 /*
 Additional helper private functions.
 */
-int smhheap_get_prev_divider(shmheap_memory_handle mem, int offset);
-int shmheap_convert_to_byte_aligned_size(int sz);
+size_t shmheap_convert_to_byte_aligned_size(size_t sz);
+int shmheap_get_size_class(long capacity);
+int shmheap_get_sub_class(long capacity, int size_class);
+long shmheap_get_capacity(shmheap_divider *divider, long cur);
+void shmheap_insert_free_block(shmheap_memory_handle mem, shmheap_region *region, long cur);
+void shmheap_remove_free_block(shmheap_memory_handle mem, shmheap_region *region, long cur);
+long shmheap_find_free_block(shmheap_memory_handle mem, shmheap_region *region, size_t sz);
+long shmheap_find_free_block_in_classes(shmheap_memory_handle mem, shmheap_region *region, size_t sz);
+long shmheap_find_larger_free_list(shmheap_region *region, int size_class, int sub_class);
+long shmheap_find_free_block_by_address(shmheap_memory_handle mem, shmheap_region *region, size_t sz, long start);
+void shmheap_set_prev_of_next(shmheap_memory_handle mem, shmheap_region *region, long cur);
+void shmheap_lock(shmheap_memory_handle mem, shmheap_region *region);
+void shmheap_unlock(shmheap_memory_handle mem, shmheap_region *region);
+shmheap_region *shmheap_get_region(shmheap_memory_handle mem, long cur);
+shmheap_region *shmheap_relock(shmheap_memory_handle mem, shmheap_region *locked, long cur);
+int shmheap_get_num_regions(size_t len, int num_regions);
+void shmheap_init_header(shmheap_memory_handle mem, size_t len, size_t max_len, const shmheap_options *options, int num_regions);
+void shmheap_init_region(shmheap_memory_handle mem, shmheap_region *region, long start, long end);
+void shmheap_init_mutex(pthread_mutex_t *mutex);
+int shmheap_get_home_region(shmheap_memory_handle mem);
+pid_t shmheap_get_pid(void);
+void *shmheap_alloc_object(shmheap_memory_handle mem, size_t sz);
+void shmheap_trace_add(shmheap_memory_handle mem, int op, size_t sz, void *ptr);
+int shmheap_check_locked(shmheap_memory_handle mem, shmheap_region *region, int repair);
+int shmheap_check_free_lists(shmheap_memory_handle mem, shmheap_region *region, long num_free_blocks, long free_bytes);
+size_t shmheap_alloc_blocks(shmheap_memory_handle mem, size_t sz, size_t count, long *blocks);
+long shmheap_alloc_block(shmheap_memory_handle mem, shmheap_region *region, size_t sz);
+void shmheap_free_block(shmheap_memory_handle mem, shmheap_region *region, long cur);
+long shmheap_cache_alloc(shmheap_memory_handle mem, size_t sz);
+void shmheap_cache_free(shmheap_memory_handle mem, long cur);
+void shmheap_cache_release(shmheap_memory_handle mem);
+void shmheap_cache_bind(shmheap_memory_handle mem);
+void shmheap_cache_flush(shmheap_thread_cache *cache);
+void shmheap_cache_init(void);
+void shmheap_cache_thread_exit(void *arg);
+void shmheap_cache_after_fork(void);
+shmheap_thread_cache *shmheap_get_thread_cache(shmheap_memory_handle mem);
+void shmheap_cache_forget_slab(shmheap_memory_handle mem, shmheap_slab *slab);
+void shmheap_slab_flush_cache(shmheap_thread_cache *cache);
+void shmheap_depot_lock(void);
+void shmheap_depot_unlock(void);
+void shmheap_depot_flush(void);
+int shmheap_grow(shmheap_memory_handle mem, shmheap_region *region, size_t sz);
+int shmheap_open_object(const char *name, int flags, int page_mode);
+int shmheap_unlink_object(const char *name, int page_mode);
+size_t shmheap_get_page_size(int page_mode);
+void shmheap_apply_page_mode(void *ptr, size_t len, int page_mode);
+void shmheap_apply_numa_policy(void *ptr, size_t len, const shmheap_options *options);
 
 int SHMHEAP_BYTE_ALIGNMENT = 8;
 
+// regions smaller than this are not worth their lock
+#define SHMHEAP_MIN_REGION_SIZE (1 << 16)
+
+// a free block must be able to hold its free list links
+#define SHMHEAP_MIN_CAPACITY sizeof(shmheap_free_links)
+
+// blocks of the free list of a request that a segregated search looks at
+// before it takes a larger free list
+#define SHMHEAP_SCAN_LIMIT 8
+
+// shmheap_alloc_many locks each region once per batch of this many blocks
+#define SHMHEAP_ALLOC_BATCH 64
+
+static __thread shmheap_thread_cache shmheap_cache;
+static shmheap_process_cache shmheap_depot = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+static pthread_once_t shmheap_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shmheap_cache_key;
+
+// pid of the process, cached as getpid is a system call
+static pid_t shmheap_pid;
+
 shmheap_memory_handle shmheap_create(const char *name, size_t len) {
 
+    return shmheap_create_with_options(name, len, NULL);
+}
+
+shmheap_memory_handle shmheap_create_with_options(const char *name, size_t len, const shmheap_options *options) {
+
+    shmheap_options default_options = {0};
+    if (options == NULL) {
+        options = &default_options;
+    }
+
+    int num_regions = shmheap_get_num_regions(len, options->num_regions);
+    long heap_start = (long) (sizeof(shmheap_header) + num_regions * sizeof(shmheap_region));
+
+    // the header comes on top of the len bytes asked for, so that the
+    // bookkeeping in it does not eat into the space for blocks.
+    // Huge pages can only be mapped in whole
+    size_t page_size = shmheap_get_page_size(options->page_mode);
+    len = (len + heap_start + page_size - 1) / page_size * page_size;
+
+    // reserve room for the heap to grow in the virtual address space
+    size_t max_len = len;
+    if (options->max_len + heap_start > len) {
+        max_len = (options->max_len + heap_start + page_size - 1) / page_size * page_size;
+    }
+    if (max_len > SHMHEAP_MAX_LEN) {
+        fprintf(stderr, "heap of %zu bytes is longer than SHMHEAP_MAX_LEN\n", max_len);
+        exit(1);
+    }
+
     //create new shared memory object via shm_open
-    int fd = shm_open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    int fd = shmheap_open_object(name, O_RDWR | O_CREAT, options->page_mode);
 	if (fd == -1) {
 		perror("open failed\n");
 		exit(1);
@@ -33,7 +129,8 @@ shmheap_memory_handle shmheap_create(const char *name, size_t len) {
 	// create mapping between shared memory object and 
     // virtual address space via mmap 
     // returns ptr to address space
-	void *ptr = mmap(NULL, len, PROT_WRITE | PROT_READ, MAP_SHARED_VALIDATE, fd, 0);
+    // the part of the mapping beyond len becomes usable once the object grows
+	void *ptr = mmap(NULL, max_len, PROT_WRITE | PROT_READ, MAP_SHARED_VALIDATE, fd, 0);
     if (ptr == (void *) -1) {
     	perror("mmap failed\n");
     	exit(1);
@@ -45,25 +142,20 @@ shmheap_memory_handle shmheap_create(const char *name, size_t len) {
         exit(1);
     }
 
+    // place the pages before any of them is touched
+    shmheap_apply_page_mode(ptr, max_len, options->page_mode);
+    shmheap_apply_numa_policy(ptr, max_len, options);
+
     // store name, len, ptr in shmheap_memory_handle
     // name is used to uniquely identify the shared memory object
     shmheap_memory_handle handle;
     handle.name = (char *) name;
-    handle.len = len;
+    handle.len = max_len;
     handle.ptr = ptr;
 
 
-    // create first divider in shared heap
-    sem_t *first_divider_ptr = (sem_t *) ptr;
-    if (sem_init(first_divider_ptr, 1 , 1) != 0) {
-        perror("sem_init failed\n");
-        exit(1);
-    }
-
-    // create divider in shared heap
-    shmheap_divider *divider_ptr =  (shmheap_divider *) (ptr + sizeof(sem_t));
-    divider_ptr->next = len;
-    divider_ptr->is_free = 1;
+    // create header in shared heap
+    shmheap_init_header(handle, len, max_len, options, num_regions);
 
     // return shmheap_memory_handle
     return handle;
@@ -71,8 +163,14 @@ shmheap_memory_handle shmheap_create(const char *name, size_t len) {
 
 shmheap_memory_handle shmheap_connect(const char *name) {
 
-    // open shared memory object that already exists via shm_open
-	int fd = shm_open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    // open shared memory object that already exists via shm_open,
+    // unless the heap lives in hugetlbfs
+    int page_mode = SHMHEAP_PAGES_HUGETLB;
+	int fd = shmheap_open_object(name, O_RDWR, page_mode);
+    if (fd == -1) {
+        page_mode = SHMHEAP_PAGES_DEFAULT;
+        fd = shmheap_open_object(name, O_RDWR | O_CREAT, page_mode);
+    }
 	if (fd == -1) {
 		perror("open failed\n");
 		exit(1);
@@ -84,7 +182,21 @@ shmheap_memory_handle shmheap_connect(const char *name) {
         perror("stat failed\n");
         exit(1);
     }
-    int len = s.st_size;
+    size_t len = s.st_size;
+
+    // read the length reserved for the heap to grow from the header,
+    // with pread since hugetlbfs cannot map less than a huge page
+    shmheap_header header;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+        perror("pread failed\n");
+        exit(1);
+    }
+    if (header.max_len > len) {
+        len = header.max_len;
+    }
+    if (page_mode != SHMHEAP_PAGES_HUGETLB) {
+        page_mode = header.page_mode;
+    }
 
     // create mapping between shared memory object and 
     // virtual address space via mmap 
@@ -101,6 +213,10 @@ shmheap_memory_handle shmheap_connect(const char *name) {
         exit(1);
     }
 
+    // the NUMA policy belongs to the shared memory object, but the huge page
+    // advice belongs to the mapping of each process
+    shmheap_apply_page_mode(ptr, len, page_mode);
+
     // store name, len in shmheap_memory_handle
     // name is used to uniquely identify the shared memory object
     shmheap_memory_handle handle;
@@ -114,6 +230,9 @@ shmheap_memory_handle shmheap_connect(const char *name) {
 
 void shmheap_disconnect(shmheap_memory_handle mem) {
 
+    // give cached blocks back before the heap goes away
+    shmheap_cache_release(mem);
+
     // unmap from shared memory object via munmap
 	if (munmap(mem.ptr, mem.len) != 0) {
 		perror("munmap failed\n");
@@ -123,10 +242,17 @@ void shmheap_disconnect(shmheap_memory_handle mem) {
 
 void shmheap_destroy(const char *name, shmheap_memory_handle mem) {
 
-    // destroy semaphore
-    if (sem_destroy(mem.ptr) != 0) {
-        perror("sem_destroy failed\n");
-        exit(1);
+    // forget cached blocks before the heap goes away
+    shmheap_cache_release(mem);
+    int page_mode = ((shmheap_header *) mem.ptr)->page_mode;
+
+    // destroy mutexes
+    shmheap_header *header = (shmheap_header *) mem.ptr;
+    for (int i = 0; i < header->num_regions; i++) {
+        if (pthread_mutex_destroy(&header->regions[i].mutex) != 0) {
+            perror("pthread_mutex_destroy failed\n");
+            exit(1);
+        }
     }
 
 	// unmap from shared memory object via munmap
@@ -136,150 +262,481 @@ void shmheap_destroy(const char *name, shmheap_memory_handle mem) {
     }
 
 	// unlink the shared memory via shm_unlink
-    if (shm_unlink(name) == -1) {
+    if (shmheap_unlink_object(name, page_mode) == -1) {
     	perror("shm_unlink failed\n");
     	exit(1);
     }
 }
 
+shmheap_memory_handle shmheap_open_file(const char *path, size_t len) {
+
+    shmheap_memory_handle handle;
+    handle.name = (char *) path;
+
+    // (1) without a heap image to reopen, lay out a new heap in the file.
+    // The file has a single region and no room to grow, see shmheap_grow
+    struct stat s;
+    if (stat(path, &s) != 0 || s.st_size == 0) {
+        shmheap_options options = {0};
+        long heap_start = (long) (sizeof(shmheap_header) + sizeof(shmheap_region));
+        size_t page_size = shmheap_get_page_size(SHMHEAP_PAGES_DEFAULT);
+        len = (len + heap_start + page_size - 1) / page_size * page_size;
+        if (len > SHMHEAP_MAX_LEN) {
+            fprintf(stderr, "heap of %zu bytes is longer than SHMHEAP_MAX_LEN\n", len);
+            exit(1);
+        }
+        handle.len = len;
+        handle.ptr = mmf_create_or_open(path, len);
+        shmheap_init_header(handle, len, len, &options, 1);
+        return handle;
+    }
+
+    // (2) map the image as it is and make sure that it is a heap laid out
+    // by this version, before any of it is trusted
+    handle.len = s.st_size;
+    handle.ptr = mmf_create_or_open(path, handle.len);
+    shmheap_header *header = (shmheap_header *) handle.ptr;
+    if (handle.len < sizeof(shmheap_header) || header->magic != SHMHEAP_MAGIC ||
+            header->version != SHMHEAP_VERSION || header->len != handle.len ||
+            header->max_len != handle.len || header->page_mode != SHMHEAP_PAGES_DEFAULT ||
+            header->num_regions != 1 ||
+            header->heap_start != (long) (sizeof(shmheap_header) + sizeof(shmheap_region))) {
+        fprintf(stderr, "%s is not a heap image\n", path);
+        exit(1);
+    }
+
+    // (3) the lock is in whatever state the last process left it in,
+    // and that process is gone
+    for (int i = 0; i < header->num_regions; i++) {
+        shmheap_init_mutex(&header->regions[i].mutex);
+    }
+
+    // (4) the last process may have died in the middle of an update
+    shmheap_check(handle, 1);
+
+    return handle;
+}
+
+void shmheap_close_file(shmheap_memory_handle mem) {
+
+    // give cached blocks back, they would be lost for good otherwise
+    shmheap_cache_release(mem);
+
+    // write the heap back to the file before unmapping it
+    if (msync(mem.ptr, mem.len, MS_SYNC) != 0) {
+        perror("msync failed\n");
+        exit(1);
+    }
+    mmf_close(mem.ptr, mem.len);
+}
+
+void shmheap_set_root(shmheap_memory_handle mem, void *ptr) {
+
+    ((shmheap_header *) mem.ptr)->root = ptr == NULL ? 0 : ptr - mem.ptr;
+}
+
+void *shmheap_get_root(shmheap_memory_handle mem) {
+
+    long root = ((shmheap_header *) mem.ptr)->root;
+    return root == 0 ? NULL : mem.ptr + root;
+}
+
 void *shmheap_underlying(shmheap_memory_handle mem) {
 
     return mem.ptr;
 }
 
 void *shmheap_alloc(shmheap_memory_handle mem, size_t sz) {
-    
-    int cur;
-    int capacity;
-    sz = (size_t) shmheap_convert_to_byte_aligned_size((int) sz);
-    shmheap_divider *divider;
- 
 
-    if (sem_wait(mem.ptr) != 0) {
-        perror("sem_wait failed\n");
-        exit(1);
+    void *ptr = shmheap_alloc_object(mem, sz);
+
+    // record the call if the heap is being traced, see shmheap_trace_start
+    if (((shmheap_header *) mem.ptr)->trace != 0) {
+        shmheap_trace_add(mem, SHMHEAP_TRACE_ALLOC, sz, ptr);
     }
+    return ptr;
+}
 
-    cur = sizeof(sem_t);
+/*
+    Allocates an object of sz bytes, see shmheap_alloc.
+*/
+void *shmheap_alloc_object(shmheap_memory_handle mem, size_t sz) {
 
-    while (cur < (int) mem.len) {
- 
-        // look at the current divider.
-        divider = (shmheap_divider *) (mem.ptr + cur);
+    sz = shmheap_convert_to_byte_aligned_size(sz);
+    if (sz < SHMHEAP_MIN_CAPACITY) {
+        sz = SHMHEAP_MIN_CAPACITY;
+    }
 
-        // check if the space on the right of the divider is free.
-        if (divider->is_free == 1) {
-            
-            // Since the space is free,
-            // calculate the capacity of this space.
-            capacity = divider->next - cur - sizeof(shmheap_divider);
-
-            // if capacity == sz
-            // in this case, we don't need to add new divider
-            // we need to :
-            // (1) change is_free in divider to 0
-            // (2) shift cur to position of data
-            if (capacity == (int) sz) {
-      
-                // (1) change is_free in divider to 0
-                divider->is_free = 0;
+    // small blocks are served from the thread cache without taking the lock
+    if (sz <= SHMHEAP_CACHE_MAX_SIZE) {
+        long cur = shmheap_cache_alloc(mem, sz);
+        if (cur == -1) {
+            return NULL;
+        }
+        return mem.ptr + cur + sizeof(shmheap_divider);
+    }
 
-                // (2) shift cur to position of data
-                cur += sizeof(shmheap_divider);
+    // the heap is full, give back what this process holds and try once more
+    long cur;
+    if (shmheap_alloc_blocks(mem, sz, 1, &cur) == 0) {
+        shmheap_flush_cache(mem);
+        if (shmheap_alloc_blocks(mem, sz, 1, &cur) == 0) {
+            return NULL;
+        }
+    }
+    return mem.ptr + cur + sizeof(shmheap_divider);
+}
 
-                break;
+void shmheap_free(shmheap_memory_handle mem, void *ptr) {
+
+    // record the call before the block can be handed out again
+    if (((shmheap_header *) mem.ptr)->trace != 0) {
+        shmheap_trace_add(mem, SHMHEAP_TRACE_FREE, 0, ptr);
+    }
+
+    long cur = ptr - mem.ptr - sizeof(shmheap_divider);
+    shmheap_divider *divider = (shmheap_divider *) (mem.ptr + cur);
+
+    // small blocks go back to the thread cache without taking the lock
+    if (shmheap_get_capacity(divider, cur) <= SHMHEAP_CACHE_MAX_SIZE) {
+        shmheap_cache_free(mem, cur);
+        return;
+    }
+
+    shmheap_region *region = shmheap_get_region(mem, cur);
+    shmheap_lock(mem, region);
+    shmheap_free_block(mem, region, cur);
+    shmheap_unlock(mem, region);
+}
+
+void shmheap_flush_cache(shmheap_memory_handle mem) {
+
+    shmheap_depot_lock();
+    if (shmheap_cache.mem.ptr == mem.ptr) {
+        shmheap_cache_flush(&shmheap_cache);
+    }
+    if (shmheap_depot.mem.ptr == mem.ptr) {
+        shmheap_depot_flush();
+    }
+    shmheap_depot_unlock();
+}
+
+void shmheap_stats(shmheap_memory_handle mem, shmheap_heap_stats *out) {
+
+    shmheap_header *header = (shmheap_header *) mem.ptr;
+    memset(out, 0, sizeof(shmheap_heap_stats));
+
+    // one region is locked at a time, so the snapshot is not atomic
+    for (int i = 0; i < header->num_regions; i++) {
+        shmheap_region *region = &header->regions[i];
+        shmheap_lock(mem, region);
+
+        // (1) add up the counters
+        out->len = header->len;
+        out->free_bytes += region->free_bytes;
+        for (int k = 0; k < SHMHEAP_NUM_SIZE_CLASSES; k++) {
+            out->num_free_blocks[k] += region->num_free_blocks[k];
+        }
+        out->num_allocs += region->num_allocs;
+        out->num_frees += region->num_frees;
+
+        // (2) the largest free block is in the largest non-empty free list
+        if (region->non_empty_classes != 0) {
+            int size_class = 31 - __builtin_clz(region->non_empty_classes);
+            int sub_class = 31 - __builtin_clz(region->non_empty_sub_classes[size_class]);
+            long cur = region->free_lists[size_class][sub_class];
+            while (cur != -1) {
+                shmheap_divider *divider = (shmheap_divider *) (mem.ptr + cur);
+                long capacity = shmheap_get_capacity(divider, cur);
+                if (capacity > (long) out->largest_free_block) {
+                    out->largest_free_block = capacity;
+                }
+                cur = ((shmheap_free_links *) (divider + 1))->next_free;
             }
+        }
 
-            // if capacity >= size of data + new divider
-            // in this case we need to allocate space for data and new divider
-            // we need to:
-            // (1) create new divider and insert it at the end of the new data
-            // (2) update current divider
-            // (3) shift cur to position of data
-            else if (capacity >= (int) sz + (int) sizeof(shmheap_divider)) {
-              
-                // (1) create new divider and insert it at the end of the data
-                shmheap_divider new_divider;
-                new_divider.next = divider->next;
-                new_divider.is_free = 1;
-                shmheap_divider *new_divider_ptr =  (shmheap_divider *) (mem.ptr + cur + sizeof(shmheap_divider) + sz);
-                *new_divider_ptr = new_divider;
-
-                // (2) update current divider
-                divider->is_free = 0;
-                divider->next = cur + sizeof(shmheap_divider) + sz;
+        shmheap_unlock(mem, region);
+    }
+}
 
-                // (3) shift cur to position of data
-                cur += sizeof(shmheap_divider);
+size_t shmheap_alloc_many(shmheap_memory_handle mem, size_t sz, size_t count, void **ptrs) {
 
-                break;
+    size_t requested = sz;
+    sz = shmheap_convert_to_byte_aligned_size(sz);
+    if (sz < SHMHEAP_MIN_CAPACITY) {
+        sz = SHMHEAP_MIN_CAPACITY;
+    }
+
+    // positions are gathered a batch at a time and then turned into pointers
+    long blocks[SHMHEAP_ALLOC_BATCH];
+    int traced = ((shmheap_header *) mem.ptr)->trace != 0;
+    size_t allocated = 0;
+    while (allocated < count) {
+        size_t wanted = count - allocated;
+        if (wanted > SHMHEAP_ALLOC_BATCH) {
+            wanted = SHMHEAP_ALLOC_BATCH;
+        }
+        size_t got = shmheap_alloc_blocks(mem, sz, wanted, blocks);
+        for (size_t i = 0; i < got; i++) {
+            ptrs[allocated] = mem.ptr + blocks[i] + sizeof(shmheap_divider);
+            if (traced) {
+                shmheap_trace_add(mem, SHMHEAP_TRACE_ALLOC, requested, ptrs[allocated]);
             }
+            allocated++;
+        }
+        if (got < wanted) {
+            break;
         }
-        cur = divider->next;        
     }
- 
-    if (sem_post(mem.ptr) != 0) {
-        perror("sem_post failed\n");
-        exit(1);
+
+    return allocated;
+}
+
+void shmheap_free_many(shmheap_memory_handle mem, void **ptrs, size_t count) {
+
+    shmheap_region *region = NULL;
+    int traced = ((shmheap_header *) mem.ptr)->trace != 0;
+    for (size_t i = 0; i < count; i++) {
+        if (traced) {
+            shmheap_trace_add(mem, SHMHEAP_TRACE_FREE, 0, ptrs[i]);
+        }
+        long cur = ptrs[i] - mem.ptr - sizeof(shmheap_divider);
+        region = shmheap_relock(mem, region, cur);
+        shmheap_free_block(mem, region, cur);
+    }
+    if (region != NULL) {
+        shmheap_unlock(mem, region);
     }
-    return mem.ptr + cur;
 }
 
-void shmheap_free(shmheap_memory_handle mem, void *ptr) {
-    
-    if (sem_wait(mem.ptr) != 0) {
-        perror("sem_wait failed\n");
-        exit(1);
+shmheap_arena shmheap_arena_create(shmheap_memory_handle mem, size_t chunk_size) {
+
+    shmheap_arena arena;
+    arena.mem = mem;
+    arena.chunk = NULL;
+    arena.used = 0;
+    arena.capacity = 0;
+    arena.chunk_size = chunk_size;
+    return arena;
+}
+
+void *shmheap_arena_alloc(shmheap_arena *arena, size_t sz) {
+
+    sz = shmheap_convert_to_byte_aligned_size(sz);
+
+    // if the most recent chunk is full, we need to:
+    // (1) allocate a new chunk that can hold sz bytes
+    // (2) chain it to the most recent chunk
+    if (arena->chunk == NULL || arena->capacity - arena->used < sz) {
+
+        // (1) allocate a new chunk that can hold sz bytes
+        size_t capacity = sz > arena->chunk_size ? sz : arena->chunk_size;
+        void **chunk = shmheap_alloc(arena->mem, sizeof(void *) + capacity);
+        if (chunk == NULL) {
+            return NULL;
+        }
+
+        // (2) chain it to the most recent chunk
+        *chunk = arena->chunk;
+        arena->chunk = chunk;
+        arena->used = 0;
+        arena->capacity = capacity;
+    }
+
+    void *ptr = arena->chunk + sizeof(void *) + arena->used;
+    arena->used += sz;
+    return ptr;
+}
+
+void shmheap_arena_release(shmheap_arena *arena) {
+
+    // free all chunks, locking each region once for a run of its chunks
+    shmheap_region *region = NULL;
+    while (arena->chunk != NULL) {
+        void *chunk = arena->chunk;
+        arena->chunk = *(void **) chunk;
+        long cur = chunk - arena->mem.ptr - sizeof(shmheap_divider);
+        region = shmheap_relock(arena->mem, region, cur);
+        shmheap_free_block(arena->mem, region, cur);
+    }
+    if (region != NULL) {
+        shmheap_unlock(arena->mem, region);
+    }
+    arena->used = 0;
+    arena->capacity = 0;
+}
+
+/*
+    Gets up to count free blocks that can hold sz bytes and marks them as
+    used, starting in the home region of the process and moving on to the
+    other regions when it is full. Each region is locked once.
+    sz must already be byte aligned.
+    Returns the number of blocks written to blocks.
+*/
+size_t shmheap_alloc_blocks(shmheap_memory_handle mem, size_t sz, size_t count, long *blocks) {
+
+    shmheap_header *header = (shmheap_header *) mem.ptr;
+    int home = shmheap_get_home_region(mem);
+    size_t allocated = 0;
+
+    for (int i = 0; i < header->num_regions && allocated < count; i++) {
+        shmheap_region *region = &header->regions[(home + i) % header->num_regions];
+        shmheap_lock(mem, region);
+        while (allocated < count) {
+            long cur = shmheap_alloc_block(mem, region, sz);
+            if (cur == -1) {
+                break;
+            }
+            blocks[allocated++] = cur;
+        }
+        shmheap_unlock(mem, region);
+    }
+
+    return allocated;
+}
+
+/*
+    Gets a free block that can hold sz bytes from region and marks it as used.
+    sz must already be byte aligned. The caller must hold the region lock.
+    If no such block exists, return -1.
+*/
+long shmheap_alloc_block(shmheap_memory_handle mem, shmheap_region *region, size_t sz) {
+
+    long cur;
+    long capacity;
+    shmheap_divider *divider;
+
+    // look up a free block that can hold sz bytes in the free lists,
+    // growing the heap if there is none and region is the last one
+    cur = shmheap_find_free_block(mem, region, sz);
+    if (cur == -1 && shmheap_grow(mem, region, sz + sizeof(shmheap_divider)) == 0) {
+        cur = shmheap_find_free_block(mem, region, sz);
+    }
+
+    if (cur != -1) {
+
+        divider = (shmheap_divider *) (mem.ptr + cur);
+        capacity = shmheap_get_capacity(divider, cur);
+        shmheap_remove_free_block(mem, region, cur);
+
+        // if the remaining space can hold a free block of its own
+        // we need to:
+        // (1) create new divider and insert it at the end of the data
+        // (2) point the following divider back to the new divider
+        // (3) add the new free block to its free list
+        if (capacity >= (long) (sz + sizeof(shmheap_divider) + SHMHEAP_MIN_CAPACITY)) {
+
+            // (1) create new divider and insert it at the end of the data
+            long new_cur = cur + sizeof(shmheap_divider) + sz;
+            shmheap_divider *new_divider_ptr = (shmheap_divider *) (mem.ptr + new_cur);
+            new_divider_ptr->next = divider->next;
+            new_divider_ptr->prev = cur;
+            new_divider_ptr->is_free = 1;
+            divider->next = new_cur;
+
+            // (2) point the following divider back to the new divider
+            shmheap_set_prev_of_next(mem, region, new_cur);
+
+            // (3) add the new free block to its free list
+            shmheap_insert_free_block(mem, region, new_cur);
+        }
+
+        // otherwise the whole block is handed out
+        divider->is_free = 0;
+        region->num_allocs++;
+
+        // the next next-fit search starts after this block
+        region->rover = divider->next == region->end ? region->start : divider->next;
     }
 
+    return cur;
+}
+
+/*
+    Marks the used block at cur in region as free and merges it with its
+    free neighbours. The caller must hold the region lock.
+*/
+void shmheap_free_block(shmheap_memory_handle mem, shmheap_region *region, long cur) {
+
     // get current divider
-    int cur = ptr - mem.ptr - sizeof(shmheap_divider);
     shmheap_divider *divider = (shmheap_divider *) (mem.ptr + cur);
+    region->num_frees++;
 
     // check if next divider exists 
     shmheap_divider *next_divider = NULL;
-    if (divider->next != (int) mem.len) {
+    if (divider->next != region->end) {
         next_divider = (shmheap_divider *) (mem.ptr + divider->next);
     }
 
     // check if previous divider exists 
     shmheap_divider *prev_divider = NULL;
-    int prev = smhheap_get_prev_divider(mem, cur);
+    long prev = divider->prev;
     if (prev != -1) {
         prev_divider = (shmheap_divider *) (mem.ptr + prev);
     }
     // if previous and next dividers both exist and are free
-    // (1) update previous divider
+    // (1) take previous and next blocks out of their free lists
+    // (2) update previous divider
+    // (3) add the merged block to its free list
     if (prev_divider != NULL && next_divider != NULL &&
             next_divider->is_free == 1 && prev_divider->is_free == 1) {
         
-        // (1) update previous divider prev
+        // (1) take previous and next blocks out of their free lists
+        shmheap_remove_free_block(mem, region, prev);
+        shmheap_remove_free_block(mem, region, divider->next);
+
+        // (2) update previous divider prev
         prev_divider->next = next_divider->next;
+        shmheap_set_prev_of_next(mem, region, prev);
 
+        // (3) add the merged block to its free list
+        shmheap_insert_free_block(mem, region, prev);
+        cur = prev;
     }
     // if previous divider exists and is free (implies that next divider does not exist or is not free)
-    // (1) update previous divider
+    // (1) take previous block out of its free list
+    // (2) update previous divider
+    // (3) add the merged block to its free list
     else if (prev_divider != NULL && prev_divider->is_free == 1) {
 
-        // (1) update previous divider
+        // (1) take previous block out of its free list
+        shmheap_remove_free_block(mem, region, prev);
+
+        // (2) update previous divider
         prev_divider->next = divider->next;
+        shmheap_set_prev_of_next(mem, region, prev);
 
+        // (3) add the merged block to its free list
+        shmheap_insert_free_block(mem, region, prev);
+        cur = prev;
     }
     // if next divider exists and is free (implies that prev divider does not exist or is not free))
-    // (1) update current divider
+    // (1) take next block out of its free list
+    // (2) update current divider
+    // (3) add the merged block to its free list
     else if (next_divider != NULL && next_divider->is_free == 1) {
 
-        // (1) update current divider
+        // (1) take next block out of its free list
+        shmheap_remove_free_block(mem, region, divider->next);
+
+        // (2) update current divider
         divider->next = next_divider->next;
         divider->is_free = 1;
+        shmheap_set_prev_of_next(mem, region, cur);
 
+        // (3) add the merged block to its free list
+        shmheap_insert_free_block(mem, region, cur);
     }
     // if previous and next dividers either does not exist or is not free
     // (1) update current divider
+    // (2) add the block to its free list
     else if ((next_divider == NULL || next_divider->is_free == 0) && (prev_divider == NULL || prev_divider->is_free == 0)) {
         
         // (1) update current divider
         divider->is_free = 1;
+
+        // (2) add the block to its free list
+        shmheap_insert_free_block(mem, region, cur);
     }
 
     else {
@@ -287,10 +744,9 @@ void shmheap_free(shmheap_memory_handle mem, void *ptr) {
         exit(1);
     }
 
-
-    if (sem_post(mem.ptr) != 0) {
-        perror("sem_post failed\n");
-        exit(1);
+    // the rover must not point into the middle of the merged block at cur
+    if (region->rover > cur && region->rover < ((shmheap_divider *) (mem.ptr + cur))->next) {
+        region->rover = cur;
     }
 }
 
@@ -313,23 +769,991 @@ void *shmheap_handle_to_ptr(shmheap_memory_handle mem, shmheap_object_handle hdl
 }
 
 /*
-    Gets the offset for the previous divider, if it exists.
-    If previous divider does not exists, return -1.
+    Grows the heap by at least sz bytes, doubling its length if possible.
+    The new space becomes a free block after the last divider of the last
+    region, which is region. The caller must hold the region lock.
+    The heap never grows past max_len, which is at most SHMHEAP_MAX_LEN.
+    If region is not the last one or the heap cannot grow that much, return -1.
 */
-int smhheap_get_prev_divider(shmheap_memory_handle mem, int offset) {
+int shmheap_grow(shmheap_memory_handle mem, shmheap_region *region, size_t sz) {
 
-    int prev = -1;
-    int cur = sizeof(sem_t);
-    while (cur < offset) {
-        shmheap_divider *ptr = (shmheap_divider *) (mem.ptr + cur);
-        prev = cur;
-        cur = ptr->next;
+    shmheap_header *header = (shmheap_header *) mem.ptr;
+    size_t old_len = header->len;
+    if (region != &header->regions[header->num_regions - 1] || header->max_len - shmheap_convert_to_byte_aligned_size(old_len) < sz) {
+        return -1;
+    }
+
+    // (1) work out the new length, a multiple of the page size
+    size_t page_size = shmheap_get_page_size(header->page_mode);
+    size_t new_len = old_len * 2 > old_len + sz ? old_len * 2 : old_len + sz;
+    new_len = (new_len + page_size - 1) / page_size * page_size;
+    if (new_len > header->max_len) {
+        new_len = header->max_len;
+    }
+
+    // (2) resize shared memory object, every process already maps up to max_len
+    int fd = shmheap_open_object(mem.name, O_RDWR, header->page_mode);
+    if (fd == -1) {
+        perror("open failed\n");
+        return -1;
+    }
+    if (ftruncate(fd, new_len) != 0) {
+        perror("ftruncate failed\n");
+        close(fd);
+        return -1;
+    }
+    if (close(fd) == -1) {
+        perror("close failed\n");
+        exit(1);
+    }
+
+    // (3) create a used block over the new space after the last divider
+    // and free it, which merges it with the last block if that is free
+    long cur = (long) shmheap_convert_to_byte_aligned_size(old_len);
+    shmheap_divider *divider = (shmheap_divider *) (mem.ptr + cur);
+    divider->next = new_len;
+    divider->prev = region->last;
+    divider->is_free = 0;
+    ((shmheap_divider *) (mem.ptr + region->last))->next = cur;
+    region->end = new_len;
+    region->last = cur;
+    header->len = new_len;
+    shmheap_free_block(mem, region, cur);
+
+    // the new space was never handed out
+    region->num_frees--;
+
+    return 0;
+}
+
+/*
+    Opens the object backing the heap: a file in hugetlbfs for huge pages,
+    a shared memory object otherwise.
+*/
+int shmheap_open_object(const char *name, int flags, int page_mode) {
+
+    if (page_mode != SHMHEAP_PAGES_HUGETLB) {
+        return shm_open(name, flags, S_IRUSR | S_IWUSR);
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", SHMHEAP_HUGETLBFS_DIR, name[0] == '/' ? name + 1 : name);
+    return open(path, flags, S_IRUSR | S_IWUSR);
+}
+
+int shmheap_unlink_object(const char *name, int page_mode) {
+
+    if (page_mode != SHMHEAP_PAGES_HUGETLB) {
+        return shm_unlink(name);
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", SHMHEAP_HUGETLBFS_DIR, name[0] == '/' ? name + 1 : name);
+    return unlink(path);
+}
+
+size_t shmheap_get_page_size(int page_mode) {
+
+    if (page_mode == SHMHEAP_PAGES_HUGETLB) {
+        return SHMHEAP_HUGE_PAGE_SIZE;
+    }
+    return sysconf(_SC_PAGESIZE);
+}
+
+/*
+    Advises the kernel to back the mapping with transparent huge pages.
+    Shared memory only gets them if
+    /sys/kernel/mm/transparent_hugepage/shmem_enabled allows it.
+*/
+void shmheap_apply_page_mode(void *ptr, size_t len, int page_mode) {
+
+    if (page_mode == SHMHEAP_PAGES_TRANSPARENT_HUGE && madvise(ptr, len, MADV_HUGEPAGE) != 0) {
+        perror("madvise failed\n");
+        exit(1);
+    }
+}
+
+/*
+    Binds or interleaves the pages of the heap across NUMA nodes. The policy
+    is stored with the shared memory object, so it holds for every process.
+*/
+void shmheap_apply_numa_policy(void *ptr, size_t len, const shmheap_options *options) {
+
+    if (options->numa_policy == SHMHEAP_NUMA_DEFAULT) {
+        return;
+    }
+    int mode = options->numa_policy == SHMHEAP_NUMA_BIND ? MPOL_BIND : MPOL_INTERLEAVE;
+    unsigned long nodes = options->numa_nodes;
+    // the kernel drops the last bit of maxnode, so pass one more than the mask holds
+    if (syscall(SYS_mbind, ptr, len, mode, &nodes, sizeof(nodes) * 8 + 1, MPOL_MF_MOVE) != 0) {
+        perror("mbind failed\n");
+        exit(1);
+    }
+}
+
+/*
+    Points the divider after the divider at cur back to cur, if it exists.
+    Otherwise the divider at cur is the last one.
+*/
+void shmheap_set_prev_of_next(shmheap_memory_handle mem, shmheap_region *region, long cur) {
+
+    shmheap_divider *divider = (shmheap_divider *) (mem.ptr + cur);
+    if (divider->next != region->end) {
+        ((shmheap_divider *) (mem.ptr + divider->next))->prev = cur;
+    } else {
+        region->last = cur;
     }
-    return prev;
 }
 
+size_t shmheap_convert_to_byte_aligned_size(size_t sz) {
+    return (sz + SHMHEAP_BYTE_ALIGNMENT - 1) & ~(size_t) (SHMHEAP_BYTE_ALIGNMENT - 1);
+}
+
+/*
+    Gets the free list that a block with the given capacity belongs to.
+*/
+int shmheap_get_size_class(long capacity) {
+
+    int size_class = 0;
+    capacity >>= 4;
+    while (capacity > 0 && size_class < SHMHEAP_NUM_SIZE_CLASSES - 1) {
+        capacity >>= 1;
+        size_class++;
+    }
+    return size_class;
+}
+
+/*
+    Gets the number of bytes to the right of the divider at cur.
+*/
+long shmheap_get_capacity(shmheap_divider *divider, long cur) {
+    return divider->next - cur - sizeof(shmheap_divider);
+}
+
+/*
+    Gets the free list within size_class that a block with the given
+    capacity belongs to.
+*/
+int shmheap_get_sub_class(long capacity, int size_class) {
+
+    long sub_class = size_class == 0 ? capacity >> 1 : (capacity >> size_class) - 8;
+    return sub_class < SHMHEAP_NUM_SUB_CLASSES ? (int) sub_class : SHMHEAP_NUM_SUB_CLASSES - 1;
+}
 
-int shmheap_convert_to_byte_aligned_size(int sz) {
-    return (sz % 8) + sz;
+/*
+    Pushes the free block at cur to the front of its free list.
+*/
+void shmheap_insert_free_block(shmheap_memory_handle mem, shmheap_region *region, long cur) {
+
+    shmheap_divider *divider = (shmheap_divider *) (mem.ptr + cur);
+    shmheap_free_links *links = (shmheap_free_links *) (divider + 1);
+    long capacity = shmheap_get_capacity(divider, cur);
+    int size_class = shmheap_get_size_class(capacity);
+    int sub_class = shmheap_get_sub_class(capacity, size_class);
+
+    long next = region->free_lists[size_class][sub_class];
+    links->next_free = next;
+    links->prev_free = -1;
+    if (next != -1) {
+        shmheap_free_links *next_links = (shmheap_free_links *) (mem.ptr + next + sizeof(shmheap_divider));
+        next_links->prev_free = cur;
+    }
+    region->free_lists[size_class][sub_class] = cur;
+    region->non_empty_classes |= 1u << size_class;
+    region->non_empty_sub_classes[size_class] |= 1u << sub_class;
+    region->free_bytes += capacity;
+    region->num_free_blocks[size_class]++;
 }
 
+/*
+    Unlinks the free block at cur from its free list.
+*/
+void shmheap_remove_free_block(shmheap_memory_handle mem, shmheap_region *region, long cur) {
+
+    shmheap_divider *divider = (shmheap_divider *) (mem.ptr + cur);
+    shmheap_free_links *links = (shmheap_free_links *) (divider + 1);
+    long capacity = shmheap_get_capacity(divider, cur);
+    int size_class = shmheap_get_size_class(capacity);
+    int sub_class = shmheap_get_sub_class(capacity, size_class);
+
+    if (links->prev_free != -1) {
+        shmheap_free_links *prev_links = (shmheap_free_links *) (mem.ptr + links->prev_free + sizeof(shmheap_divider));
+        prev_links->next_free = links->next_free;
+    } else {
+        region->free_lists[size_class][sub_class] = links->next_free;
+        if (links->next_free == -1) {
+            region->non_empty_sub_classes[size_class] &= ~(1u << sub_class);
+            if (region->non_empty_sub_classes[size_class] == 0) {
+                region->non_empty_classes &= ~(1u << size_class);
+            }
+        }
+    }
+    if (links->next_free != -1) {
+        shmheap_free_links *next_links = (shmheap_free_links *) (mem.ptr + links->next_free + sizeof(shmheap_divider));
+        next_links->prev_free = links->prev_free;
+    }
+    region->free_bytes -= capacity;
+    region->num_free_blocks[size_class]--;
+}
+
+/*
+    Gets the position of a free block that can hold sz bytes, as picked by
+    the policy of the heap.
+    If no such block exists, return -1.
+*/
+long shmheap_find_free_block(shmheap_memory_handle mem, shmheap_region *region, size_t sz) {
+
+    shmheap_header *header = (shmheap_header *) mem.ptr;
+    switch (header->policy) {
+    case SHMHEAP_POLICY_FIRST_FIT:
+        return shmheap_find_free_block_by_address(mem, region, sz, region->start);
+    case SHMHEAP_POLICY_NEXT_FIT:
+        return shmheap_find_free_block_by_address(mem, region, sz, region->rover);
+    default:
+        return shmheap_find_free_block_in_classes(mem, region, sz);
+    }
+}
+
+/*
+    Gets the position of a free block in region that can hold sz bytes from the free lists.
+    Blocks in the free list of sz itself may be too small, and every block
+    in a larger free list is big enough. Segregated searches the first
+    SHMHEAP_SCAN_LIMIT blocks of the list of sz first-fit and then takes the
+    head of the smallest non-empty larger list. Good-fit takes that head
+    first, and picks the smallest block that fits from the list of sz
+    otherwise. Either way the rest of the list of sz is only walked when no
+    larger list has a block.
+    If no such block exists, return -1.
+*/
+long shmheap_find_free_block_in_classes(shmheap_memory_handle mem, shmheap_region *region, size_t sz) {
+
+    shmheap_header *header = (shmheap_header *) mem.ptr;
+    int size_class = shmheap_get_size_class(sz);
+    int sub_class = shmheap_get_sub_class(sz, size_class);
+    int good_fit = header->policy == SHMHEAP_POLICY_GOOD_FIT;
+
+    if (good_fit) {
+        long larger = shmheap_find_larger_free_list(region, size_class, sub_class);
+        if (larger != -1) {
+            return larger;
+        }
+    }
+
+    // (1) look at the first blocks of the list of sz
+    long found = -1;
+    long found_capacity = 0;
+    long cur = region->free_lists[size_class][sub_class];
+    for (int limit = good_fit ? -1 : SHMHEAP_SCAN_LIMIT; cur != -1 && limit != 0; limit--) {
+        shmheap_divider *divider = (shmheap_divider *) (mem.ptr + cur);
+        long capacity = shmheap_get_capacity(divider, cur);
+        if (capacity >= (long) sz && (found == -1 || capacity < found_capacity)) {
+            found = cur;
+            found_capacity = capacity;
+            if (!good_fit || capacity == (long) sz) {
+                break;
+            }
+        }
+        cur = ((shmheap_free_links *) (divider + 1))->next_free;
+    }
+    if (found != -1 || good_fit) {
+        return found;
+    }
+
+    // (2) take a block of a larger list
+    long larger = shmheap_find_larger_free_list(region, size_class, sub_class);
+    if (larger != -1 || cur == -1) {
+        return larger;
+    }
+
+    // (3) every larger list is empty, so walk the rest of the list of sz
+    while (cur != -1) {
+        shmheap_divider *divider = (shmheap_divider *) (mem.ptr + cur);
+        if (shmheap_get_capacity(divider, cur) >= (long) sz) {
+            return cur;
+        }
+        cur = ((shmheap_free_links *) (divider + 1))->next_free;
+    }
+    return -1;
+}
+
+/*
+    Gets the head of the smallest non-empty free list of region that comes
+    after free list sub_class of size_class.
+    If every such list is empty, return -1.
+*/
+long shmheap_find_larger_free_list(shmheap_region *region, int size_class, int sub_class) {
+
+    // (1) larger lists of the same class
+    unsigned int larger_sub_classes = region->non_empty_sub_classes[size_class] & (~0u << (sub_class + 1));
+    if (larger_sub_classes != 0) {
+        return region->free_lists[size_class][__builtin_ctz(larger_sub_classes)];
+    }
+
+    // (2) first list of the smallest larger class
+    if (size_class == SHMHEAP_NUM_SIZE_CLASSES - 1) {
+        return -1;
+    }
+    unsigned int larger_classes = region->non_empty_classes & (~0u << (size_class + 1));
+    if (larger_classes == 0) {
+        return -1;
+    }
+    size_class = __builtin_ctz(larger_classes);
+    return region->free_lists[size_class][__builtin_ctz(region->non_empty_sub_classes[size_class])];
+}
+
+/*
+    Gets the position of the first free block in region that can hold sz
+    bytes, walking the dividers from start to the end of the region and
+    then from the start of the region back to start.
+    If no such block exists, return -1.
+*/
+long shmheap_find_free_block_by_address(shmheap_memory_handle mem, shmheap_region *region, size_t sz, long start) {
+
+    long cur = start;
+    do {
+        shmheap_divider *divider = (shmheap_divider *) (mem.ptr + cur);
+        if (divider->is_free == 1 && shmheap_get_capacity(divider, cur) >= (long) sz) {
+            return cur;
+        }
+        cur = divider->next == region->end ? region->start : divider->next;
+    } while (cur != start);
+
+    return -1;
+}
+
+/*
+    Locks region. If the previous owner of the lock died while holding
+    it, the region may be half way through an update, so it is repaired
+    before the lock is marked consistent again.
+*/
+void shmheap_lock(shmheap_memory_handle mem, shmheap_region *region) {
+
+    int res = pthread_mutex_lock(&region->mutex);
+    if (res == EOWNERDEAD) {
+        shmheap_check_locked(mem, region, 1);
+        res = pthread_mutex_consistent(&region->mutex);
+    }
+    if (res != 0) {
+        errno = res;
+        perror("pthread_mutex_lock failed\n");
+        exit(1);
+    }
+}
+
+void shmheap_unlock(shmheap_memory_handle mem, shmheap_region *region) {
+
+    (void) mem;
+    if (pthread_mutex_unlock(&region->mutex) != 0) {
+        perror("pthread_mutex_unlock failed\n");
+        exit(1);
+    }
+}
+
+/*
+    Gets the region that the block at cur belongs to. Every region but the
+    last one has the same size, and the last one takes the rest of the heap.
+*/
+shmheap_region *shmheap_get_region(shmheap_memory_handle mem, long cur) {
+
+    shmheap_header *header = (shmheap_header *) mem.ptr;
+    long index = (cur - header->heap_start) / header->region_size;
+    if (index >= header->num_regions) {
+        index = header->num_regions - 1;
+    }
+    return &header->regions[index];
+}
+
+/*
+    Gets the region of the block at cur with its lock held, where locked is
+    the region whose lock the caller holds, NULL if none. The lock of
+    locked is kept if cur is in it, otherwise it is released first.
+*/
+shmheap_region *shmheap_relock(shmheap_memory_handle mem, shmheap_region *locked, long cur) {
+
+    shmheap_region *region = shmheap_get_region(mem, cur);
+    if (region != locked) {
+        if (locked != NULL) {
+            shmheap_unlock(mem, locked);
+        }
+        shmheap_lock(mem, region);
+    }
+    return region;
+}
+
+/*
+    Gets how many regions a heap of len bytes is split into when
+    num_regions are asked for.
+*/
+int shmheap_get_num_regions(size_t len, int num_regions) {
+
+    // every region must have room for blocks of a reasonable size
+    if (num_regions > SHMHEAP_MAX_REGIONS) {
+        num_regions = SHMHEAP_MAX_REGIONS;
+    }
+    while (num_regions > 1 && len / num_regions < SHMHEAP_MIN_REGION_SIZE) {
+        num_regions--;
+    }
+    if (num_regions < 1) {
+        num_regions = 1;
+    }
+    return num_regions;
+}
+
+/*
+    Sets up the header of a new heap of len bytes, split into num_regions
+    regions that are all free.
+*/
+void shmheap_init_header(shmheap_memory_handle mem, size_t len, size_t max_len, const shmheap_options *options, int num_regions) {
+
+    long heap_start = (long) (sizeof(shmheap_header) + num_regions * sizeof(shmheap_region));
+    shmheap_header *header = (shmheap_header *) mem.ptr;
+    header->magic = SHMHEAP_MAGIC;
+    header->version = SHMHEAP_VERSION;
+    header->len = len;
+    header->max_len = max_len;
+    header->page_mode = options->page_mode;
+    header->policy = options->policy;
+    header->num_regions = num_regions;
+    header->region_size = (long) ((len - heap_start) / num_regions) & ~7L;
+    header->heap_start = heap_start;
+    header->root = 0;
+    header->trace = 0;
+
+    // split the heap into regions, the last one takes what is left
+    for (int i = 0; i < num_regions; i++) {
+        long start = heap_start + i * header->region_size;
+        long end = i == num_regions - 1 ? (long) len : start + header->region_size;
+        shmheap_init_region(mem, &header->regions[i], start, end);
+    }
+}
+
+/*
+    Sets up region as the lock and free lists of [start, end), all of it
+    one free block.
+*/
+void shmheap_init_region(shmheap_memory_handle mem, shmheap_region *region, long start, long end) {
+
+    shmheap_init_mutex(&region->mutex);
+    for (int i = 0; i < SHMHEAP_NUM_SIZE_CLASSES; i++) {
+        for (int j = 0; j < SHMHEAP_NUM_SUB_CLASSES; j++) {
+            region->free_lists[i][j] = -1;
+        }
+        region->non_empty_sub_classes[i] = 0;
+    }
+    region->non_empty_classes = 0;
+    region->start = start;
+    region->end = end;
+    region->last = start;
+    region->rover = start;
+    region->free_bytes = 0;
+    memset(region->num_free_blocks, 0, sizeof(region->num_free_blocks));
+    region->num_allocs = 0;
+    region->num_frees = 0;
+
+    // create divider in shared heap
+    shmheap_divider *divider = (shmheap_divider *) (mem.ptr + start);
+    divider->next = end;
+    divider->prev = -1;
+    divider->is_free = 1;
+    shmheap_insert_free_block(mem, region, start);
+}
+
+/*
+    Initialises a lock that processes sharing the heap can take, and that
+    is handed over when its owner dies, see shmheap_lock.
+*/
+void shmheap_init_mutex(pthread_mutex_t *mutex) {
+
+    pthread_mutexattr_t attr;
+    if (pthread_mutexattr_init(&attr) != 0 ||
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0 ||
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0 ||
+            pthread_mutex_init(mutex, &attr) != 0) {
+        perror("pthread_mutex_init failed\n");
+        exit(1);
+    }
+    pthread_mutexattr_destroy(&attr);
+}
+
+/*
+    Gets the region where the calling process looks for free blocks first.
+*/
+int shmheap_get_home_region(shmheap_memory_handle mem) {
+
+    return shmheap_get_pid() % ((shmheap_header *) mem.ptr)->num_regions;
+}
+
+/*
+    Gets the pid of the calling process without a system call.
+*/
+pid_t shmheap_get_pid(void) {
+
+    // the pid is forgotten after fork, see shmheap_cache_after_fork
+    if (shmheap_pid == 0) {
+        if (pthread_once(&shmheap_cache_once, shmheap_cache_init) != 0) {
+            perror("pthread_once failed\n");
+            exit(1);
+        }
+        shmheap_pid = getpid();
+    }
+    return shmheap_pid;
+}
+
+int shmheap_check(shmheap_memory_handle mem, int repair) {
+
+    shmheap_header *header = (shmheap_header *) mem.ptr;
+    int problems = 0;
+    for (int i = 0; i < header->num_regions; i++) {
+        shmheap_lock(mem, &header->regions[i]);
+        problems += shmheap_check_locked(mem, &header->regions[i], repair);
+        shmheap_unlock(mem, &header->regions[i]);
+    }
+    return problems;
+}
+
+/*
+    Checks, and repairs if asked to, the dividers and free lists of region.
+    Every update of a divider chain is a single store of a next field, so a
+    dead process leaves behind at most one divider that points nowhere,
+    stale back-offsets, two free blocks that were about to be merged, and
+    free lists in any state.
+    The caller must hold the region lock.
+    Returns the number of problems found.
+*/
+int shmheap_check_locked(shmheap_memory_handle mem, shmheap_region *region, int repair) {
+
+    shmheap_header *header = (shmheap_header *) mem.ptr;
+    int problems = 0;
+    long num_free_blocks = 0;
+    long free_bytes = 0;
+
+    // (0) the last region may have died growing the heap after moving its end
+    if (region == &header->regions[header->num_regions - 1] && region->end != (long) header->len) {
+        problems++;
+        if (repair) {
+            header->len = region->end;
+        }
+    }
+
+    // (1) walk the dividers
+    long prev = -1;
+    long cur = region->start;
+    while (cur != region->end) {
+        shmheap_divider *divider = (shmheap_divider *) (mem.ptr + cur);
+
+        // the chain must move forward and stay within the region,
+        // otherwise the block is cut off at the end of the region
+        if (divider->next < cur + (long) (sizeof(shmheap_divider) + SHMHEAP_MIN_CAPACITY) ||
+                divider->next > region->end || divider->next % 8 != 0) {
+            problems++;
+            if (!repair) {
+                break;
+            }
+            divider->next = region->end;
+        }
+
+        // a block of unknown state is kept, as it may be in use
+        if (divider->is_free != 0 && divider->is_free != 1) {
+            problems++;
+            if (repair) {
+                divider->is_free = 0;
+            }
+        }
+
+        if (divider->prev != prev) {
+            problems++;
+            if (repair) {
+                divider->prev = prev;
+            }
+        }
+
+        // adjacent free blocks are merged into the previous one
+        shmheap_divider *prev_divider = (shmheap_divider *) (mem.ptr + prev);
+        if (prev != -1 && divider->is_free == 1 && prev_divider->is_free == 1) {
+            problems++;
+            if (repair) {
+                free_bytes += divider->next - prev_divider->next;
+                prev_divider->next = divider->next;
+                cur = divider->next;
+                continue;
+            }
+        }
+
+        if (divider->is_free == 1) {
+            num_free_blocks++;
+            free_bytes += shmheap_get_capacity(divider, cur);
+        }
+        prev = cur;
+        cur = divider->next;
+    }
+
+    if (region->last != prev) {
+        problems++;
+        if (repair) {
+            region->last = prev;
+        }
+    }
+
+    // (2) check that the free lists hold exactly the free blocks
+    if (shmheap_check_free_lists(mem, region, num_free_blocks, free_bytes) != 0) {
+        problems++;
+    }
+
+    // (3) rebuild the free lists from the dividers
+    if (repair && problems != 0) {
+        for (int i = 0; i < SHMHEAP_NUM_SIZE_CLASSES; i++) {
+            for (int j = 0; j < SHMHEAP_NUM_SUB_CLASSES; j++) {
+                region->free_lists[i][j] = -1;
+            }
+            region->non_empty_sub_classes[i] = 0;
+            region->num_free_blocks[i] = 0;
+        }
+        region->non_empty_classes = 0;
+        region->free_bytes = 0;
+        region->rover = region->start;
+        for (cur = region->start; cur != region->end; cur = ((shmheap_divider *) (mem.ptr + cur))->next) {
+            if (((shmheap_divider *) (mem.ptr + cur))->is_free == 1) {
+                shmheap_insert_free_block(mem, region, cur);
+            }
+        }
+    }
+
+    return problems;
+}
+
+/*
+    Checks that the free lists and the statistics of region agree with
+    the num_free_blocks free blocks holding free_bytes bytes in it.
+    Lists are followed for at most num_free_blocks steps, so a cycle
+    cannot hang the check.
+    If they do not agree, return -1.
+*/
+int shmheap_check_free_lists(shmheap_memory_handle mem, shmheap_region *region, long num_free_blocks, long free_bytes) {
+
+    if (region->free_bytes != free_bytes) {
+        return -1;
+    }
+
+    long num_listed = 0;
+    for (int i = 0; i < SHMHEAP_NUM_SIZE_CLASSES; i++) {
+        long num_in_class = 0;
+        if ((region->non_empty_sub_classes[i] != 0) != ((region->non_empty_classes >> i) & 1)) {
+            return -1;
+        }
+        for (int j = 0; j < SHMHEAP_NUM_SUB_CLASSES; j++) {
+            long prev = -1;
+            long cur = region->free_lists[i][j];
+            if ((cur != -1) != ((region->non_empty_sub_classes[i] >> j) & 1)) {
+                return -1;
+            }
+            while (cur != -1) {
+                if (num_listed == num_free_blocks || cur < region->start || cur >= region->end) {
+                    return -1;
+                }
+                shmheap_divider *divider = (shmheap_divider *) (mem.ptr + cur);
+                shmheap_free_links *links = (shmheap_free_links *) (divider + 1);
+                long capacity = shmheap_get_capacity(divider, cur);
+                if (divider->is_free != 1 || links->prev_free != prev ||
+                        shmheap_get_size_class(capacity) != i || shmheap_get_sub_class(capacity, i) != j) {
+                    return -1;
+                }
+                num_listed++;
+                num_in_class++;
+                prev = cur;
+                cur = links->next_free;
+            }
+        }
+        if (num_in_class != region->num_free_blocks[i]) {
+            return -1;
+        }
+    }
+
+    return num_listed == num_free_blocks ? 0 : -1;
+}
+
+/*
+    Gets a block that can hold sz bytes from the thread cache, refilling
+    the cache from the process cache or the shared heap when it is empty.
+    sz must already be byte aligned.
+    If no such block exists, return -1.
+*/
+long shmheap_cache_alloc(shmheap_memory_handle mem, size_t sz) {
+
+    if (shmheap_cache.mem.ptr != mem.ptr) {
+        shmheap_cache_bind(mem);
+    }
+    shmheap_magazine *magazine = &shmheap_cache.magazines[sz / 8 - 1];
+
+    // (1) take blocks from the process cache
+    if (magazine->count == 0) {
+        shmheap_depot_lock();
+        if (shmheap_depot.mem.ptr == mem.ptr) {
+            int *count = &shmheap_depot.counts[sz / 8 - 1];
+            while (*count > 0 && magazine->count < SHMHEAP_MAGAZINE_SIZE / 2) {
+                magazine->blocks[magazine->count++] = shmheap_depot.blocks[sz / 8 - 1][--(*count)];
+            }
+        }
+        shmheap_depot_unlock();
+    }
+
+    // (2) take blocks from the shared heap, with one lock acquisition
+    if (magazine->count == 0) {
+        magazine->count = (int) shmheap_alloc_blocks(mem, sz, SHMHEAP_MAGAZINE_SIZE / 2, magazine->blocks);
+    }
+
+    // (3) the heap is full, give back what this process holds and try once more
+    if (magazine->count == 0) {
+        shmheap_flush_cache(mem);
+        long cur;
+        return shmheap_alloc_blocks(mem, sz, 1, &cur) == 1 ? cur : -1;
+    }
+
+    return magazine->blocks[--magazine->count];
+}
+
+/*
+    Puts the used block at cur into the thread cache, moving half of the
+    magazine to the process cache or the shared heap when it is full.
+*/
+void shmheap_cache_free(shmheap_memory_handle mem, long cur) {
+
+    if (shmheap_cache.mem.ptr != mem.ptr) {
+        shmheap_cache_bind(mem);
+    }
+    shmheap_divider *divider = (shmheap_divider *) (mem.ptr + cur);
+    int bin = (int) (shmheap_get_capacity(divider, cur) / 8 - 1);
+    shmheap_magazine *magazine = &shmheap_cache.magazines[bin];
+
+    if (magazine->count == SHMHEAP_MAGAZINE_SIZE) {
+
+        // (1) move blocks to the process cache
+        shmheap_depot_lock();
+        if (shmheap_depot.mem.ptr != mem.ptr) {
+            shmheap_depot_flush();
+            shmheap_depot.mem = mem;
+        }
+        int *count = &shmheap_depot.counts[bin];
+        while (*count < SHMHEAP_DEPOT_SIZE && magazine->count > SHMHEAP_MAGAZINE_SIZE / 2) {
+            shmheap_depot.blocks[bin][(*count)++] = magazine->blocks[--magazine->count];
+        }
+        shmheap_depot_unlock();
+
+        // (2) move the rest to the shared heap, locking each region once
+        // for a run of its blocks
+        shmheap_region *region = NULL;
+        while (magazine->count > SHMHEAP_MAGAZINE_SIZE / 2) {
+            long block = magazine->blocks[--magazine->count];
+            region = shmheap_relock(mem, region, block);
+            shmheap_free_block(mem, region, block);
+        }
+        if (region != NULL) {
+            shmheap_unlock(mem, region);
+        }
+    }
+
+    magazine->blocks[magazine->count++] = cur;
+}
+
+/*
+    Makes the thread cache hold blocks of the heap mem, giving the blocks
+    of the heap it held before back to that heap.
+*/
+void shmheap_cache_bind(shmheap_memory_handle mem) {
+
+    if (pthread_once(&shmheap_cache_once, shmheap_cache_init) != 0) {
+        perror("pthread_once failed\n");
+        exit(1);
+    }
+
+    shmheap_depot_lock();
+    if (shmheap_cache.mem.ptr != NULL) {
+        shmheap_cache_flush(&shmheap_cache);
+    }
+    if (!shmheap_cache.is_registered) {
+        // register the thread cache so that it is emptied when the thread exits
+        if (pthread_setspecific(shmheap_cache_key, &shmheap_cache) != 0) {
+            perror("pthread_setspecific failed\n");
+            exit(1);
+        }
+        shmheap_cache.next = shmheap_depot.thread_caches;
+        shmheap_depot.thread_caches = &shmheap_cache;
+        shmheap_cache.is_registered = 1;
+    }
+    shmheap_cache.mem = mem;
+    shmheap_depot_unlock();
+}
+
+/*
+    Gets the thread cache, made to hold blocks of the heap mem.
+*/
+shmheap_thread_cache *shmheap_get_thread_cache(shmheap_memory_handle mem) {
+
+    if (shmheap_cache.mem.ptr != mem.ptr) {
+        shmheap_cache_bind(mem);
+    }
+    return &shmheap_cache;
+}
+
+/*
+    Makes the thread caches of the process forget the objects of slab that
+    they hold, as they go away with it.
+*/
+void shmheap_cache_forget_slab(shmheap_memory_handle mem, shmheap_slab *slab) {
+
+    shmheap_depot_lock();
+    for (shmheap_thread_cache *cache = shmheap_depot.thread_caches; cache != NULL; cache = cache->next) {
+        if (cache->mem.ptr == mem.ptr && cache->slab == (void *) slab - mem.ptr) {
+            cache->slab = 0;
+            cache->slab_count = 0;
+        }
+    }
+    shmheap_depot_unlock();
+}
+
+/*
+    Gives every block cached by the process for the heap mem back to it.
+*/
+void shmheap_cache_release(shmheap_memory_handle mem) {
+
+    shmheap_depot_lock();
+    for (shmheap_thread_cache *cache = shmheap_depot.thread_caches; cache != NULL; cache = cache->next) {
+        if (cache->mem.ptr == mem.ptr) {
+            shmheap_cache_flush(cache);
+        }
+    }
+    if (shmheap_depot.mem.ptr == mem.ptr) {
+        shmheap_depot_flush();
+    }
+    shmheap_depot_unlock();
+}
+
+/*
+    Gives every block in the thread cache back to its heap.
+    The caller must hold the process cache mutex.
+*/
+void shmheap_cache_flush(shmheap_thread_cache *cache) {
+
+    if (cache->mem.ptr == NULL) {
+        return;
+    }
+    shmheap_slab_flush_cache(cache);
+    shmheap_region *region = NULL;
+    for (int i = 0; i < SHMHEAP_CACHE_NUM_BINS; i++) {
+        shmheap_magazine *magazine = &cache->magazines[i];
+        while (magazine->count > 0) {
+            long block = magazine->blocks[--magazine->count];
+            region = shmheap_relock(cache->mem, region, block);
+            shmheap_free_block(cache->mem, region, block);
+        }
+    }
+    if (region != NULL) {
+        shmheap_unlock(cache->mem, region);
+    }
+    cache->mem.ptr = NULL;
+}
+
+void shmheap_cache_init(void) {
+
+    if (pthread_key_create(&shmheap_cache_key, shmheap_cache_thread_exit) != 0) {
+        perror("pthread_key_create failed\n");
+        exit(1);
+    }
+    if (pthread_atfork(NULL, NULL, shmheap_cache_after_fork) != 0) {
+        perror("pthread_atfork failed\n");
+        exit(1);
+    }
+}
+
+/*
+    Moves the blocks of an exiting thread to the process cache, and the
+    ones that do not fit there to the shared heap.
+*/
+void shmheap_cache_thread_exit(void *arg) {
+
+    shmheap_thread_cache *cache = (shmheap_thread_cache *) arg;
+
+    shmheap_depot_lock();
+    if (cache->mem.ptr != NULL) {
+        if (shmheap_depot.mem.ptr != cache->mem.ptr) {
+            shmheap_depot_flush();
+            shmheap_depot.mem = cache->mem;
+        }
+        for (int i = 0; i < SHMHEAP_CACHE_NUM_BINS; i++) {
+            shmheap_magazine *magazine = &cache->magazines[i];
+            while (shmheap_depot.counts[i] < SHMHEAP_DEPOT_SIZE && magazine->count > 0) {
+                shmheap_depot.blocks[i][shmheap_depot.counts[i]++] = magazine->blocks[--magazine->count];
+            }
+        }
+        shmheap_cache_flush(cache);
+    }
+
+    // unregister the thread cache
+    shmheap_thread_cache **link = &shmheap_depot.thread_caches;
+    while (*link != cache) {
+        link = &(*link)->next;
+    }
+    *link = cache->next;
+    cache->is_registered = 0;
+    shmheap_depot_unlock();
+}
+
+/*
+    The blocks cached before fork belong to the parent, so the child
+    forgets them instead of handing them out a second time.
+*/
+void shmheap_cache_after_fork(void) {
+
+    if (pthread_mutex_init(&shmheap_depot.mutex, NULL) != 0) {
+        perror("pthread_mutex_init failed\n");
+        exit(1);
+    }
+    memset(shmheap_depot.counts, 0, sizeof(shmheap_depot.counts));
+    shmheap_depot.mem.ptr = NULL;
+    shmheap_depot.thread_caches = NULL;
+
+    memset(shmheap_cache.magazines, 0, sizeof(shmheap_cache.magazines));
+    shmheap_cache.slab = 0;
+    shmheap_cache.slab_count = 0;
+    shmheap_cache.mem.ptr = NULL;
+    shmheap_cache.is_registered = 0;
+
+    // the child hashes to its own home region
+    shmheap_pid = 0;
+}
+
+void shmheap_depot_lock(void) {
+
+    if (pthread_mutex_lock(&shmheap_depot.mutex) != 0) {
+        perror("pthread_mutex_lock failed\n");
+        exit(1);
+    }
+}
+
+void shmheap_depot_unlock(void) {
+
+    if (pthread_mutex_unlock(&shmheap_depot.mutex) != 0) {
+        perror("pthread_mutex_unlock failed\n");
+        exit(1);
+    }
+}
+
+/*
+    Gives every block in the process cache back to its heap.
+    The caller must hold the process cache mutex.
+*/
+void shmheap_depot_flush(void) {
+
+    if (shmheap_depot.mem.ptr == NULL) {
+        return;
+    }
+    shmheap_region *region = NULL;
+    for (int i = 0; i < SHMHEAP_CACHE_NUM_BINS; i++) {
+        while (shmheap_depot.counts[i] > 0) {
+            long block = shmheap_depot.blocks[i][--shmheap_depot.counts[i]];
+            region = shmheap_relock(shmheap_depot.mem, region, block);
+            shmheap_free_block(shmheap_depot.mem, region, block);
+        }
+    }
+    if (region != NULL) {
+        shmheap_unlock(shmheap_depot.mem, region);
+    }
+    shmheap_depot.mem.ptr = NULL;
+}
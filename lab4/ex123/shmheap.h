@@ -8,16 +8,25 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <semaphore.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 
+#include "mmf.h"
+
 /*
 You should modify these structs to suit your implementation,
 but remember that all the functions declared here must have
@@ -33,11 +42,206 @@ requirements in the lab document.  If you declare additional names (helper struc
 typedef struct {
     // position of next divider relative to the start of heap, 
     // value = length of heap if next divider does not exist.
-    int next;
+    long next;
+
+    // position of previous divider relative to the start of heap,
+    // value = -1 if previous divider does not exist.
+    long prev;
 
     // Whether the data to the right is free    
     int is_free; 
-} shmheap_divider; // 8 bytes
+
+    // keeps the data to the right 8-byte aligned
+    int padding;
+} shmheap_divider; // 24 bytes
+
+
+// Number of segregated free lists. Free list k holds the free blocks
+// whose capacity lies in [8 << k, 8 << (k + 1)), the last list holds
+// every block that is larger than that.
+#define SHMHEAP_NUM_SIZE_CLASSES 29
+
+// Each size class is split into this many free lists of equal width, so
+// list j of class k holds capacities in [(8 + j) << k, (9 + j) << k).
+// The last list of the last class also holds every larger block.
+#define SHMHEAP_NUM_SUB_CLASSES 8
+
+// Links of a free block, stored in the (unused) data to the right of
+// its divider. Values are divider positions relative to the start of
+// heap, -1 if there is no such block.
+typedef struct {
+    long next_free;
+    long prev_free;
+} shmheap_free_links; // 16 bytes
+
+
+#define SHMHEAP_CACHE_LINE 64
+
+// Part of the heap with its own lock, free lists and divider chain.
+// Blocks never span two regions, so processes working in different
+// regions do not contend. Regions sit on their own cache lines.
+typedef struct {
+    // robust process-shared mutex guarding the region. If its owner dies,
+    // the next process to lock it repairs the region with shmheap_check
+    pthread_mutex_t mutex;
+
+    // position of the first divider in each free list, -1 if empty
+    long free_lists[SHMHEAP_NUM_SIZE_CLASSES][SHMHEAP_NUM_SUB_CLASSES];
+
+    // bit k is set iff some free list of class k is not empty, and bit j
+    // of non_empty_sub_classes[k] iff free_lists[k][j] is not empty
+    unsigned int non_empty_classes;
+    unsigned char non_empty_sub_classes[SHMHEAP_NUM_SIZE_CLASSES];
+
+    // positions of the first divider and of the end of the region.
+    // The next of the last divider of the region is end
+    long start;
+    long end;
+
+    // position of the last divider
+    long last;
+
+    // position of the divider where the next next-fit search starts
+    long rover;
+
+    // counters for shmheap_stats, kept up to date under the region lock
+    long free_bytes;
+    long num_free_blocks[SHMHEAP_NUM_SIZE_CLASSES];
+    long num_allocs;
+    long num_frees;
+} __attribute__((aligned(SHMHEAP_CACHE_LINE))) shmheap_region;
+
+// Most regions a heap can be split into.
+#define SHMHEAP_MAX_REGIONS 64
+
+// Marks the first bytes of a heap, so that a file that is not a heap image,
+// or one laid out by another version of this library, is not opened as one.
+// Bump SHMHEAP_VERSION whenever the layout of the header, regions or
+// dividers changes.
+#define SHMHEAP_MAGIC 0x50484853
+#define SHMHEAP_VERSION 3
+
+// Longest a heap can be, header included, so that a shmheap_rel_ptr can
+// reach every object in it. Creating a heap, or reserving room for one to
+// grow, past this length fails.
+#define SHMHEAP_MAX_LEN ((size_t) 1 << 35)
+
+// Header at the start of the shared heap, shared by every process
+// connected to the heap. The regions follow the header, and the first
+// divider follows the regions.
+typedef struct {
+    // SHMHEAP_MAGIC and SHMHEAP_VERSION
+    uint32_t magic;
+    uint32_t version;
+
+    // current length of heap, the heap grows up to max_len bytes.
+    // Every process maps max_len bytes, so growing the heap never moves it.
+    // Only the last region grows
+    size_t len;
+    size_t max_len;
+
+    // pages backing the heap, see shmheap_page_mode
+    int page_mode;
+
+    // how free blocks are picked, see shmheap_policy
+    int policy;
+
+    // number of regions, every region but the last one is region_size bytes
+    int num_regions;
+    long region_size;
+
+    // position of the first divider of the first region
+    long heap_start;
+
+    // position of the object set by shmheap_set_root, 0 if there is none
+    long root;
+
+    // position of the shmheap_trace being recorded, 0 if there is none
+    long trace;
+
+    shmheap_region regions[];
+} __attribute__((aligned(SHMHEAP_CACHE_LINE))) shmheap_header;
+
+
+// Snapshot of the heap filled in by shmheap_stats, summed over its
+// regions. Blocks held in the small block caches of connected processes
+// count as allocated.
+typedef struct {
+    size_t len;
+    size_t free_bytes;
+    size_t largest_free_block;
+
+    // number of free blocks in each free list, see SHMHEAP_NUM_SIZE_CLASSES
+    long num_free_blocks[SHMHEAP_NUM_SIZE_CLASSES];
+
+    // number of blocks taken from and given back to the heap so far
+    long num_allocs;
+    long num_frees;
+} shmheap_heap_stats;
+
+
+// Pages backing the heap.
+typedef enum {
+    // regular pages of a shared memory object in /dev/shm
+    SHMHEAP_PAGES_DEFAULT,
+    // regular shared memory object, advised to use transparent huge pages
+    SHMHEAP_PAGES_TRANSPARENT_HUGE,
+    // file in the hugetlbfs mounted at SHMHEAP_HUGETLBFS_DIR, its length
+    // is rounded up to a multiple of SHMHEAP_HUGE_PAGE_SIZE
+    SHMHEAP_PAGES_HUGETLB
+} shmheap_page_mode;
+
+#define SHMHEAP_HUGETLBFS_DIR "/dev/hugepages"
+#define SHMHEAP_HUGE_PAGE_SIZE (2 << 20)
+
+// How shmheap_alloc picks a free block for a request.
+typedef enum {
+    // first fit among the first few blocks of the free list of the
+    // request, then the first block of the smallest non-empty larger free
+    // list. The rest of the free list of the request is only walked when
+    // no larger block is free
+    SHMHEAP_POLICY_SEGREGATED,
+    // first free block that fits, walking the heap from its start
+    SHMHEAP_POLICY_FIRST_FIT,
+    // first free block that fits, walking the heap from where the
+    // previous search stopped
+    SHMHEAP_POLICY_NEXT_FIT,
+    // first block of the smallest non-empty free list whose blocks all
+    // fit, so free and alloc never walk a list. The block is not always
+    // the smallest that fits, as lists are not kept in order. Only when
+    // there is none is the free list of the request searched for its
+    // smallest block that fits
+    SHMHEAP_POLICY_GOOD_FIT
+} shmheap_policy;
+
+// Placement of the heap across NUMA nodes, applied with mbind.
+typedef enum {
+    SHMHEAP_NUMA_DEFAULT,
+    // only use the nodes in numa_nodes
+    SHMHEAP_NUMA_BIND,
+    // spread pages round-robin over the nodes in numa_nodes
+    SHMHEAP_NUMA_INTERLEAVE
+} shmheap_numa_policy;
+
+// Optional settings for shmheap_create_with_options.
+typedef struct {
+    // length that the heap may grow to, 0 if it may not grow.
+    // At most SHMHEAP_MAX_LEN with the header
+    size_t max_len;
+
+    shmheap_page_mode page_mode;
+
+    shmheap_policy policy;
+
+    // number of independently locked regions, processes start looking
+    // for free blocks in the region picked by their pid and take them
+    // from the other regions when it is full. 0 means 1
+    int num_regions;
+
+    shmheap_numa_policy numa_policy;
+    // bit k is set to use NUMA node k
+    unsigned long numa_nodes;
+} shmheap_options;
 
 
 
@@ -57,12 +261,248 @@ typedef struct {
 } shmheap_object_handle;
 
 
+// Blocks with a capacity of at most SHMHEAP_CACHE_MAX_SIZE bytes are
+// cached per thread, one bin per multiple of 8 bytes.
+#define SHMHEAP_CACHE_MAX_SIZE 256
+#define SHMHEAP_CACHE_NUM_BINS (SHMHEAP_CACHE_MAX_SIZE / 8)
+
+// Number of blocks a thread keeps per bin. Half of a magazine is moved
+// to or from the shared heap at once, under a single lock acquisition.
+#define SHMHEAP_MAGAZINE_SIZE 32
+
+// Number of blocks per bin kept for the whole process.
+#define SHMHEAP_DEPOT_SIZE 256
+
+typedef struct {
+    int count;
+
+    // divider positions of the cached blocks, which stay marked as used in the heap
+    long blocks[SHMHEAP_MAGAZINE_SIZE];
+} shmheap_magazine;
+
+// Blocks freed by a thread, kept for its next allocations.
+typedef struct shmheap_thread_cache shmheap_thread_cache;
+struct shmheap_thread_cache {
+    // heap the cached blocks belong to, ptr is NULL if none
+    shmheap_memory_handle mem;
+
+    shmheap_magazine magazines[SHMHEAP_CACHE_NUM_BINS];
+
+    // position of the slab allocator of mem whose free objects are cached,
+    // 0 if none. They are chained through their first 4 bytes from
+    // slab_first to slab_last, like on its free stack
+    long slab;
+    uint32_t slab_first;
+    uint32_t slab_last;
+    int slab_count;
+
+    // next thread cache of the process
+    shmheap_thread_cache *next;
+    int is_registered;
+};
+
+// Blocks shared by all threads of the process, refilled by threads with
+// full magazines and by exiting threads.
+typedef struct {
+    pthread_mutex_t mutex;
+
+    // heap the cached blocks belong to, ptr is NULL if none
+    shmheap_memory_handle mem;
+
+    int counts[SHMHEAP_CACHE_NUM_BINS];
+    long blocks[SHMHEAP_CACHE_NUM_BINS][SHMHEAP_DEPOT_SIZE];
+
+    // thread caches of the process
+    shmheap_thread_cache *thread_caches;
+} shmheap_process_cache;
+
+
+// Allocator for objects of one fixed size, living in the shared heap.
+// Objects are carved out of slabs allocated with shmheap_alloc and are
+// handed out from a lock-free stack shared by every connected process.
+// Objects a thread frees are kept in its thread cache for its next
+// allocations, so the stack is only touched once per chain of them.
+// Positions are stored in units of 8 bytes relative to the start of
+// heap, 0 if there is no such object.
+typedef struct {
+    // bits 0-31: position of the first free object
+    // bits 32-63: tag, incremented on every change to avoid ABA
+    uint64_t free_stack;
+
+    // position of the first slab, slabs are chained by their first 4 bytes
+    uint32_t slabs;
+
+    // size of an object, at least 8 and byte aligned
+    uint32_t object_size;
+} shmheap_slab;
+
+// Size of the slabs that objects are carved out of.
+#define SHMHEAP_SLAB_SIZE (1 << 16)
+
+// Number of objects of a slab allocator a thread keeps. A full chain of
+// them is pushed onto the free stack at once.
+#define SHMHEAP_SLAB_MAGAZINE_SIZE 32
+
+
+// Processes sleeping on a futex word until it changes.
+typedef struct {
+    // changed, and the sleepers woken, whenever the awaited condition may hold
+    uint32_t futex;
+
+    // number of times processes announced that they are about to sleep on
+    // futex since the last wake, 0 if nobody sleeps
+    uint32_t num_waiters;
+} shmheap_queue_wait;
+
+// Slot of a shmheap_queue. sequence tells whose turn it is: a producer
+// at position pos may fill the cell once sequence == pos, a consumer may
+// empty it once sequence == pos + 1.
+typedef struct {
+    uint64_t sequence;
+    uint64_t offset;
+} shmheap_queue_cell;
+
+// Bounded lock-free multi-producer multi-consumer queue of object
+// handles, living in the shared heap. Only the offset of a handle is
+// stored, the consumer gets the name of its own memory handle.
+// Producers and consumers only make a system call when they have to
+// sleep on a full or empty queue, or when the other side is asleep.
+typedef struct {
+    // number of cells minus one, the number of cells is a power of two
+    uint64_t mask;
+    char padding0[SHMHEAP_CACHE_LINE - sizeof(uint64_t)];
+
+    // position of the next cell to fill, owned by producers
+    uint64_t enqueue_pos;
+    char padding1[SHMHEAP_CACHE_LINE - sizeof(uint64_t)];
+
+    // position of the next cell to empty, owned by consumers
+    uint64_t dequeue_pos;
+    char padding2[SHMHEAP_CACHE_LINE - sizeof(uint64_t)];
+
+    shmheap_queue_wait not_empty;
+    shmheap_queue_wait not_full;
+    char padding3[SHMHEAP_CACHE_LINE - 2 * sizeof(shmheap_queue_wait)];
+
+    shmheap_queue_cell cells[];
+} shmheap_queue;
+
+// Calls recorded by a shmheap_trace.
+typedef enum {
+    SHMHEAP_TRACE_ALLOC = 1,
+    SHMHEAP_TRACE_FREE = 2
+} shmheap_trace_op;
+
+// One call to shmheap_alloc or shmheap_free, as written by shmheap_trace_dump.
+typedef struct {
+    // position of the record in the trace plus one, 0 while it is written
+    uint64_t sequence;
+
+    // CLOCK_MONOTONIC time of the call in nanoseconds
+    uint64_t timestamp;
+
+    // position of the object relative to the start of heap,
+    // 0 for an allocation that failed
+    int64_t offset;
+
+    // bytes asked for, 0 for frees
+    uint64_t size;
+
+    int32_t pid;
+    uint32_t op;
+} shmheap_trace_record; // 40 bytes
+
+// Ring of the latest calls to shmheap_alloc and shmheap_free made by
+// every process connected to the heap, living in the shared heap.
+// A call claims a record with one atomic increment and takes no lock.
+typedef struct {
+    // number of records minus one, the number of records is a power of two
+    uint64_t mask;
+
+    // number of calls recorded so far, the latest mask + 1 of them are kept
+    uint64_t next;
+
+    shmheap_trace_record records[];
+} shmheap_trace;
+
+
+// Position of an object relative to the start of heap in units of
+// 8 bytes, 0 if there is no object. Every process can follow it, and it
+// takes a quarter of the room of a shmheap_object_handle. Heaps are kept
+// within SHMHEAP_MAX_LEN (32GB), so every object can be addressed.
+typedef uint32_t shmheap_rel_ptr;
+
+// Growable array of elem_size byte elements in the shared heap.
+// The containers below are not synchronized, processes that change
+// them concurrently must lock them themselves.
+typedef struct {
+    shmheap_rel_ptr data;
+    uint32_t elem_size;
+    uint32_t size;
+    uint32_t capacity;
+} shmheap_vector;
+
+// Slot of a shmheap_map.
+typedef struct {
+    uint64_t key;
+    uint64_t value;
+    uint32_t is_used;
+    uint32_t padding;
+} shmheap_map_entry; // 24 bytes
+
+// Hash map from 64-bit keys to 64-bit values in the shared heap, with
+// open addressing and linear probing. Values can hold shmheap_rel_ptrs.
+typedef struct {
+    shmheap_rel_ptr entries;
+    uint32_t size;
+    // number of entries minus one, the number of entries is a power of two
+    uint32_t mask;
+} shmheap_map;
+
+// Links of a shmheap_list node, the element follows them.
+typedef struct {
+    shmheap_rel_ptr next;
+    shmheap_rel_ptr prev;
+} shmheap_list_node;
+
+// Doubly linked list of elem_size byte elements in the shared heap.
+typedef struct {
+    shmheap_rel_ptr head;
+    shmheap_rel_ptr tail;
+    uint32_t size;
+    uint32_t elem_size;
+} shmheap_list;
+
+
+// Bump allocator over chunks of the shared heap, owned by one process.
+// Its objects cannot be freed one by one, shmheap_arena_release frees
+// all of them at once.
+typedef struct {
+    shmheap_memory_handle mem;
+
+    // most recent chunk, chunks are chained by their first 8 bytes
+    void *chunk;
+
+    // bytes used in and capacity of the most recent chunk
+    size_t used;
+    size_t capacity;
+
+    // capacity of a new chunk
+    size_t chunk_size;
+} shmheap_arena;
+
+// Declares an arena that is released when it goes out of scope.
+#define SHMHEAP_SCOPED_ARENA(name, mem, chunk_size) \
+    shmheap_arena name __attribute__((cleanup(shmheap_arena_release))) = shmheap_arena_create(mem, chunk_size)
+
+
 
 /*
 These functions form the public API of your shmheap library.
 */
 
 shmheap_memory_handle shmheap_create(const char *name, size_t len);
+shmheap_memory_handle shmheap_create_with_options(const char *name, size_t len, const shmheap_options *options);
 shmheap_memory_handle shmheap_connect(const char *name);
 void shmheap_disconnect(shmheap_memory_handle mem);
 void shmheap_destroy(const char *name, shmheap_memory_handle mem);
@@ -72,5 +512,95 @@ void shmheap_free(shmheap_memory_handle mem, void *ptr);
 shmheap_object_handle shmheap_ptr_to_handle(shmheap_memory_handle mem, void *ptr);
 void *shmheap_handle_to_ptr(shmheap_memory_handle mem, shmheap_object_handle hdl);
 
+// Heap kept in a regular file, so that it outlives a reboot. The file is
+// created with room for len bytes of objects if it does not exist, and
+// reopened as it is otherwise. Only one process may have it open at a time
+// and it does not grow.
+shmheap_memory_handle shmheap_open_file(const char *path, size_t len);
+void shmheap_close_file(shmheap_memory_handle mem);
+
+// Object from which the others in the heap can be found again, for
+// instance after shmheap_open_file. NULL if none was set.
+void shmheap_set_root(shmheap_memory_handle mem, void *ptr);
+void *shmheap_get_root(shmheap_memory_handle mem);
+
+// Returns the blocks cached by the calling thread and its process to the shared heap.
+void shmheap_flush_cache(shmheap_memory_handle mem);
+
+// Checks that the dividers and free lists of every region are consistent and,
+// if repair is set, fixes them: broken chains are cut at the bad divider,
+// back-offsets and the last divider are recomputed, adjacent free blocks
+// are merged and the free lists are rebuilt. Blocks that a dead process
+// had allocated or cached stay allocated.
+// Returns the number of problems found.
+int shmheap_check(shmheap_memory_handle mem, int repair);
+
+// Fills in out with the current occupancy of the heap. Only the largest
+// free list is walked, so this is cheap enough to poll.
+void shmheap_stats(shmheap_memory_handle mem, shmheap_heap_stats *out);
+
+// Allocates or frees count objects with a single acquisition of the heap lock.
+// shmheap_alloc_many returns the number of objects allocated, which is less
+// than count if the heap is full.
+size_t shmheap_alloc_many(shmheap_memory_handle mem, size_t sz, size_t count, void **ptrs);
+void shmheap_free_many(shmheap_memory_handle mem, void **ptrs, size_t count);
+
+// Arena allocator, see shmheap_arena.
+shmheap_arena shmheap_arena_create(shmheap_memory_handle mem, size_t chunk_size);
+void *shmheap_arena_alloc(shmheap_arena *arena, size_t sz);
+void shmheap_arena_release(shmheap_arena *arena);
+
+// Fixed-size object allocator, see shmheap_slab.
+// Other processes find the slab allocator through shmheap_ptr_to_handle.
+shmheap_slab *shmheap_slab_create(shmheap_memory_handle mem, size_t object_size);
+void shmheap_slab_destroy(shmheap_memory_handle mem, shmheap_slab *slab);
+void *shmheap_slab_alloc(shmheap_memory_handle mem, shmheap_slab *slab);
+void shmheap_slab_free(shmheap_memory_handle mem, shmheap_slab *slab, void *ptr);
+
+// Relative pointers, see shmheap_rel_ptr.
+shmheap_rel_ptr shmheap_ptr_to_rel(shmheap_memory_handle mem, void *ptr);
+void *shmheap_rel_to_ptr(shmheap_memory_handle mem, shmheap_rel_ptr rel);
+
+// Containers, see shmheap_vector, shmheap_map and shmheap_list.
+// Functions that add elements return -1 or NULL if the heap is full.
+shmheap_vector *shmheap_vector_create(shmheap_memory_handle mem, size_t elem_size);
+void shmheap_vector_destroy(shmheap_memory_handle mem, shmheap_vector *vec);
+int shmheap_vector_push(shmheap_memory_handle mem, shmheap_vector *vec, const void *elem);
+void shmheap_vector_pop(shmheap_vector *vec);
+void *shmheap_vector_at(shmheap_memory_handle mem, shmheap_vector *vec, size_t idx);
+
+shmheap_map *shmheap_map_create(shmheap_memory_handle mem, size_t capacity);
+void shmheap_map_destroy(shmheap_memory_handle mem, shmheap_map *map);
+int shmheap_map_put(shmheap_memory_handle mem, shmheap_map *map, uint64_t key, uint64_t value);
+int shmheap_map_get(shmheap_memory_handle mem, shmheap_map *map, uint64_t key, uint64_t *value);
+int shmheap_map_remove(shmheap_memory_handle mem, shmheap_map *map, uint64_t key);
+
+shmheap_list *shmheap_list_create(shmheap_memory_handle mem, size_t elem_size);
+void shmheap_list_destroy(shmheap_memory_handle mem, shmheap_list *list);
+void *shmheap_list_push_front(shmheap_memory_handle mem, shmheap_list *list, const void *elem);
+void *shmheap_list_push_back(shmheap_memory_handle mem, shmheap_list *list, const void *elem);
+void shmheap_list_remove(shmheap_memory_handle mem, shmheap_list *list, void *elem);
+void *shmheap_list_first(shmheap_memory_handle mem, shmheap_list *list);
+void *shmheap_list_next(shmheap_memory_handle mem, void *elem);
+
+// Message queue of object handles, see shmheap_queue.
+// capacity is rounded up to a power of two. The try functions return -1
+// instead of waiting when the queue is full or empty.
+shmheap_queue *shmheap_queue_create(shmheap_memory_handle mem, size_t capacity);
+void shmheap_queue_destroy(shmheap_memory_handle mem, shmheap_queue *queue);
+int shmheap_queue_try_push(shmheap_queue *queue, shmheap_object_handle hdl);
+int shmheap_queue_try_pop(shmheap_memory_handle mem, shmheap_queue *queue, shmheap_object_handle *hdl);
+void shmheap_queue_push(shmheap_queue *queue, shmheap_object_handle hdl);
+void shmheap_queue_pop(shmheap_memory_handle mem, shmheap_queue *queue, shmheap_object_handle *hdl);
+
+// Tracing of the heap, see shmheap_trace. capacity is rounded up to a power
+// of two. shmheap_trace_start returns -1 if the heap is already traced or
+// full. shmheap_trace_dump writes the records kept, oldest first, to out
+// and returns their number; records being written are skipped.
+// shmheap_trace_stop must not race with calls being recorded.
+int shmheap_trace_start(shmheap_memory_handle mem, size_t capacity);
+size_t shmheap_trace_dump(shmheap_memory_handle mem, FILE *out);
+void shmheap_trace_stop(shmheap_memory_handle mem);
+
 
 
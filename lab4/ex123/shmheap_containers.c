@@ -0,0 +1,338 @@
+/*************************************
+* Lab 4
+* Name:
+* Student No:
+* Lab Group:
+*************************************/
+
+#include "shmheap.h"
+
+/*
+Additional helper private functions.
+*/
+uint32_t shmheap_map_hash(uint64_t key, uint32_t mask);
+int shmheap_map_resize(shmheap_memory_handle mem, shmheap_map *map, uint32_t num_entries);
+shmheap_list_node *shmheap_list_node_of(void *elem);
+
+shmheap_rel_ptr shmheap_ptr_to_rel(shmheap_memory_handle mem, void *ptr) {
+
+    if (ptr == NULL) {
+        return 0;
+    }
+    return (shmheap_rel_ptr) ((ptr - mem.ptr) >> 3);
+}
+
+void *shmheap_rel_to_ptr(shmheap_memory_handle mem, shmheap_rel_ptr rel) {
+
+    if (rel == 0) {
+        return NULL;
+    }
+    return mem.ptr + ((size_t) rel << 3);
+}
+
+shmheap_vector *shmheap_vector_create(shmheap_memory_handle mem, size_t elem_size) {
+
+    shmheap_vector *vec = (shmheap_vector *) shmheap_alloc(mem, sizeof(shmheap_vector));
+    if (vec == NULL) {
+        return NULL;
+    }
+    vec->data = 0;
+    vec->elem_size = (uint32_t) elem_size;
+    vec->size = 0;
+    vec->capacity = 0;
+    return vec;
+}
+
+void shmheap_vector_destroy(shmheap_memory_handle mem, shmheap_vector *vec) {
+
+    if (vec->data != 0) {
+        shmheap_free(mem, shmheap_rel_to_ptr(mem, vec->data));
+    }
+    shmheap_free(mem, vec);
+}
+
+int shmheap_vector_push(shmheap_memory_handle mem, shmheap_vector *vec, const void *elem) {
+
+    // if the vector is full, we need to:
+    // (1) allocate an array of twice the capacity
+    // (2) move the elements over and free the old array
+    if (vec->size == vec->capacity) {
+
+        // (1) allocate an array of twice the capacity
+        uint32_t capacity = vec->capacity == 0 ? 4 : vec->capacity * 2;
+        void *data = shmheap_alloc(mem, (size_t) capacity * vec->elem_size);
+        if (data == NULL) {
+            return -1;
+        }
+
+        // (2) move the elements over and free the old array
+        if (vec->data != 0) {
+            void *old_data = shmheap_rel_to_ptr(mem, vec->data);
+            memcpy(data, old_data, (size_t) vec->size * vec->elem_size);
+            shmheap_free(mem, old_data);
+        }
+        vec->data = shmheap_ptr_to_rel(mem, data);
+        vec->capacity = capacity;
+    }
+
+    memcpy(shmheap_vector_at(mem, vec, vec->size), elem, vec->elem_size);
+    vec->size++;
+    return 0;
+}
+
+void shmheap_vector_pop(shmheap_vector *vec) {
+
+    if (vec->size > 0) {
+        vec->size--;
+    }
+}
+
+void *shmheap_vector_at(shmheap_memory_handle mem, shmheap_vector *vec, size_t idx) {
+
+    return shmheap_rel_to_ptr(mem, vec->data) + idx * vec->elem_size;
+}
+
+shmheap_map *shmheap_map_create(shmheap_memory_handle mem, size_t capacity) {
+
+    shmheap_map *map = (shmheap_map *) shmheap_alloc(mem, sizeof(shmheap_map));
+    if (map == NULL) {
+        return NULL;
+    }
+    map->entries = 0;
+    map->size = 0;
+    map->mask = 0;
+
+    // room for capacity keys without going over the maximum load
+    uint32_t num_entries = 8;
+    while (num_entries / 4 * 3 < capacity) {
+        num_entries <<= 1;
+    }
+    if (shmheap_map_resize(mem, map, num_entries) != 0) {
+        shmheap_free(mem, map);
+        return NULL;
+    }
+    return map;
+}
+
+void shmheap_map_destroy(shmheap_memory_handle mem, shmheap_map *map) {
+
+    shmheap_free(mem, shmheap_rel_to_ptr(mem, map->entries));
+    shmheap_free(mem, map);
+}
+
+int shmheap_map_put(shmheap_memory_handle mem, shmheap_map *map, uint64_t key, uint64_t value) {
+
+    // keep the load at most 3/4, so that probes stay short
+    if ((map->size + 1) * 4 > (map->mask + 1) * 3 &&
+            shmheap_map_resize(mem, map, (map->mask + 1) * 2) != 0) {
+        return -1;
+    }
+
+    // probe from the slot of the key up to the key or an empty slot
+    shmheap_map_entry *entries = shmheap_rel_to_ptr(mem, map->entries);
+    uint32_t idx = shmheap_map_hash(key, map->mask);
+    while (entries[idx].is_used && entries[idx].key != key) {
+        idx = (idx + 1) & map->mask;
+    }
+    if (!entries[idx].is_used) {
+        entries[idx].is_used = 1;
+        entries[idx].key = key;
+        map->size++;
+    }
+    entries[idx].value = value;
+    return 0;
+}
+
+int shmheap_map_get(shmheap_memory_handle mem, shmheap_map *map, uint64_t key, uint64_t *value) {
+
+    shmheap_map_entry *entries = shmheap_rel_to_ptr(mem, map->entries);
+    uint32_t idx = shmheap_map_hash(key, map->mask);
+    while (entries[idx].is_used) {
+        if (entries[idx].key == key) {
+            *value = entries[idx].value;
+            return 0;
+        }
+        idx = (idx + 1) & map->mask;
+    }
+    return -1;
+}
+
+int shmheap_map_remove(shmheap_memory_handle mem, shmheap_map *map, uint64_t key) {
+
+    // (1) find the key
+    shmheap_map_entry *entries = shmheap_rel_to_ptr(mem, map->entries);
+    uint32_t idx = shmheap_map_hash(key, map->mask);
+    while (entries[idx].is_used && entries[idx].key != key) {
+        idx = (idx + 1) & map->mask;
+    }
+    if (!entries[idx].is_used) {
+        return -1;
+    }
+
+    // (2) shift back the following keys that probed past the hole, so
+    // that every key stays reachable from its slot without tombstones
+    uint32_t hole = idx;
+    uint32_t cur = (idx + 1) & map->mask;
+    while (entries[cur].is_used) {
+        uint32_t home = shmheap_map_hash(entries[cur].key, map->mask);
+        if (((cur - home) & map->mask) >= ((cur - hole) & map->mask)) {
+            entries[hole] = entries[cur];
+            hole = cur;
+        }
+        cur = (cur + 1) & map->mask;
+    }
+    entries[hole].is_used = 0;
+    map->size--;
+    return 0;
+}
+
+/*
+    Gets the slot where the search for key starts.
+*/
+uint32_t shmheap_map_hash(uint64_t key, uint32_t mask) {
+
+    // finalizer of splitmix64, spreads nearby keys over the table
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return (uint32_t) key & mask;
+}
+
+/*
+    Moves the keys of map into a new table of num_entries entries.
+    If the heap is full, return -1 and keep the old table.
+*/
+int shmheap_map_resize(shmheap_memory_handle mem, shmheap_map *map, uint32_t num_entries) {
+
+    shmheap_map_entry *entries = shmheap_alloc(mem, (size_t) num_entries * sizeof(shmheap_map_entry));
+    if (entries == NULL) {
+        return -1;
+    }
+    memset(entries, 0, (size_t) num_entries * sizeof(shmheap_map_entry));
+
+    shmheap_map_entry *old_entries = shmheap_rel_to_ptr(mem, map->entries);
+    uint32_t old_num_entries = map->entries == 0 ? 0 : map->mask + 1;
+    uint32_t mask = num_entries - 1;
+    for (uint32_t i = 0; i < old_num_entries; i++) {
+        if (old_entries[i].is_used) {
+            uint32_t idx = shmheap_map_hash(old_entries[i].key, mask);
+            while (entries[idx].is_used) {
+                idx = (idx + 1) & mask;
+            }
+            entries[idx] = old_entries[i];
+        }
+    }
+
+    if (old_entries != NULL) {
+        shmheap_free(mem, old_entries);
+    }
+    map->entries = shmheap_ptr_to_rel(mem, entries);
+    map->mask = mask;
+    return 0;
+}
+
+shmheap_list *shmheap_list_create(shmheap_memory_handle mem, size_t elem_size) {
+
+    shmheap_list *list = (shmheap_list *) shmheap_alloc(mem, sizeof(shmheap_list));
+    if (list == NULL) {
+        return NULL;
+    }
+    list->head = 0;
+    list->tail = 0;
+    list->size = 0;
+    list->elem_size = (uint32_t) elem_size;
+    return list;
+}
+
+void shmheap_list_destroy(shmheap_memory_handle mem, shmheap_list *list) {
+
+    while (list->head != 0) {
+        shmheap_list_remove(mem, list, shmheap_rel_to_ptr(mem, list->head) + sizeof(shmheap_list_node));
+    }
+    shmheap_free(mem, list);
+}
+
+void *shmheap_list_push_front(shmheap_memory_handle mem, shmheap_list *list, const void *elem) {
+
+    shmheap_list_node *node = shmheap_alloc(mem, sizeof(shmheap_list_node) + list->elem_size);
+    if (node == NULL) {
+        return NULL;
+    }
+    memcpy(node + 1, elem, list->elem_size);
+
+    shmheap_rel_ptr rel = shmheap_ptr_to_rel(mem, node);
+    node->prev = 0;
+    node->next = list->head;
+    if (list->head != 0) {
+        ((shmheap_list_node *) shmheap_rel_to_ptr(mem, list->head))->prev = rel;
+    } else {
+        list->tail = rel;
+    }
+    list->head = rel;
+    list->size++;
+    return node + 1;
+}
+
+void *shmheap_list_push_back(shmheap_memory_handle mem, shmheap_list *list, const void *elem) {
+
+    shmheap_list_node *node = shmheap_alloc(mem, sizeof(shmheap_list_node) + list->elem_size);
+    if (node == NULL) {
+        return NULL;
+    }
+    memcpy(node + 1, elem, list->elem_size);
+
+    shmheap_rel_ptr rel = shmheap_ptr_to_rel(mem, node);
+    node->next = 0;
+    node->prev = list->tail;
+    if (list->tail != 0) {
+        ((shmheap_list_node *) shmheap_rel_to_ptr(mem, list->tail))->next = rel;
+    } else {
+        list->head = rel;
+    }
+    list->tail = rel;
+    list->size++;
+    return node + 1;
+}
+
+void shmheap_list_remove(shmheap_memory_handle mem, shmheap_list *list, void *elem) {
+
+    shmheap_list_node *node = shmheap_list_node_of(elem);
+    if (node->prev != 0) {
+        ((shmheap_list_node *) shmheap_rel_to_ptr(mem, node->prev))->next = node->next;
+    } else {
+        list->head = node->next;
+    }
+    if (node->next != 0) {
+        ((shmheap_list_node *) shmheap_rel_to_ptr(mem, node->next))->prev = node->prev;
+    } else {
+        list->tail = node->prev;
+    }
+    list->size--;
+    shmheap_free(mem, node);
+}
+
+void *shmheap_list_first(shmheap_memory_handle mem, shmheap_list *list) {
+
+    if (list->head == 0) {
+        return NULL;
+    }
+    return shmheap_rel_to_ptr(mem, list->head) + sizeof(shmheap_list_node);
+}
+
+void *shmheap_list_next(shmheap_memory_handle mem, void *elem) {
+
+    shmheap_list_node *node = shmheap_list_node_of(elem);
+    if (node->next == 0) {
+        return NULL;
+    }
+    return shmheap_rel_to_ptr(mem, node->next) + sizeof(shmheap_list_node);
+}
+
+/*
+    Gets the node that holds the list element at elem.
+*/
+shmheap_list_node *shmheap_list_node_of(void *elem) {
+    return (shmheap_list_node *) elem - 1;
+}
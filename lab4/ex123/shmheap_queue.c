@@ -0,0 +1,185 @@
+/*************************************
+* Lab 4
+* Name:
+* Student No:
+* Lab Group:
+*************************************/
+
+#include "shmheap.h"
+
+/*
+Additional helper private functions.
+*/
+void shmheap_queue_sleep(shmheap_queue_wait *wait, uint32_t futex);
+void shmheap_queue_wake(shmheap_queue_wait *wait);
+
+// number of failed attempts before a waiting process goes to sleep
+#define SHMHEAP_QUEUE_SPINS 100
+
+shmheap_queue *shmheap_queue_create(shmheap_memory_handle mem, size_t capacity) {
+
+    size_t num_cells = 2;
+    while (num_cells < capacity) {
+        num_cells <<= 1;
+    }
+
+    shmheap_queue *queue = (shmheap_queue *) shmheap_alloc(mem, sizeof(shmheap_queue) + num_cells * sizeof(shmheap_queue_cell));
+    if (queue == NULL) {
+        return NULL;
+    }
+    memset(queue, 0, sizeof(shmheap_queue));
+    queue->mask = num_cells - 1;
+    for (size_t i = 0; i < num_cells; i++) {
+        queue->cells[i].sequence = i;
+    }
+    return queue;
+}
+
+void shmheap_queue_destroy(shmheap_memory_handle mem, shmheap_queue *queue) {
+
+    shmheap_free(mem, queue);
+}
+
+int shmheap_queue_try_push(shmheap_queue *queue, shmheap_object_handle hdl) {
+
+    // (1) claim the cell at enqueue_pos once its previous value has been taken
+    uint64_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    shmheap_queue_cell *cell;
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        uint64_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t) (sequence - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        // the queue is full
+        else if (diff < 0) {
+            return -1;
+        }
+        // another producer claimed the cell first
+        else {
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    // (2) fill the cell and hand it to the consumers
+    cell->offset = hdl.offset;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    // (3) wake a consumer if one sleeps on the empty queue
+    shmheap_queue_wake(&queue->not_empty);
+    return 0;
+}
+
+int shmheap_queue_try_pop(shmheap_memory_handle mem, shmheap_queue *queue, shmheap_object_handle *hdl) {
+
+    // (1) claim the cell at dequeue_pos once a producer has filled it
+    uint64_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    shmheap_queue_cell *cell;
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        uint64_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t) (sequence - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        // the queue is empty
+        else if (diff < 0) {
+            return -1;
+        }
+        // another consumer claimed the cell first
+        else {
+            pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    // (2) empty the cell and hand it back to the producers of the next round
+    hdl->name = mem.name;
+    hdl->offset = cell->offset;
+    __atomic_store_n(&cell->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+
+    // (3) wake a producer if one sleeps on the full queue
+    shmheap_queue_wake(&queue->not_full);
+    return 0;
+}
+
+void shmheap_queue_push(shmheap_queue *queue, shmheap_object_handle hdl) {
+
+    int spins = 0;
+    while (shmheap_queue_try_push(queue, hdl) != 0) {
+        if (++spins < SHMHEAP_QUEUE_SPINS) {
+            continue;
+        }
+
+        // announce the sleep and read the futex word before the last attempt,
+        // so a consumer that makes room after it changes the word and the
+        // sleep returns at once. If the attempt succeeds, the announcement
+        // only costs the next consumer a needless wake
+        __atomic_fetch_add(&queue->not_full.num_waiters, 1, __ATOMIC_SEQ_CST);
+        uint32_t futex = __atomic_load_n(&queue->not_full.futex, __ATOMIC_SEQ_CST);
+        if (shmheap_queue_try_push(queue, hdl) == 0) {
+            return;
+        }
+        shmheap_queue_sleep(&queue->not_full, futex);
+    }
+}
+
+void shmheap_queue_pop(shmheap_memory_handle mem, shmheap_queue *queue, shmheap_object_handle *hdl) {
+
+    int spins = 0;
+    while (shmheap_queue_try_pop(mem, queue, hdl) != 0) {
+        if (++spins < SHMHEAP_QUEUE_SPINS) {
+            continue;
+        }
+
+        // same as shmheap_queue_push, with the roles swapped
+        __atomic_fetch_add(&queue->not_empty.num_waiters, 1, __ATOMIC_SEQ_CST);
+        uint32_t futex = __atomic_load_n(&queue->not_empty.futex, __ATOMIC_SEQ_CST);
+        if (shmheap_queue_try_pop(mem, queue, hdl) == 0) {
+            return;
+        }
+        shmheap_queue_sleep(&queue->not_empty, futex);
+    }
+}
+
+/*
+    Sleeps until the futex word of wait no longer holds futex.
+    The queue lives in shared memory, so the futex cannot be private.
+*/
+void shmheap_queue_sleep(shmheap_queue_wait *wait, uint32_t futex) {
+
+    if (syscall(SYS_futex, &wait->futex, FUTEX_WAIT, futex, NULL, NULL, 0) != 0 &&
+            errno != EAGAIN && errno != EINTR) {
+        perror("futex failed\n");
+        exit(1);
+    }
+}
+
+/*
+    Wakes every process sleeping on wait. Without sleepers this is a
+    single load, so the common case stays free of system calls. The
+    sleepers are all woken and announce themselves again if they have to
+    sleep once more, so only the first update after they fall asleep
+    makes a system call.
+*/
+void shmheap_queue_wake(shmheap_queue_wait *wait) {
+
+    // orders the update of the cell before the read of num_waiters,
+    // pairing with the increment of num_waiters by a sleeper
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&wait->num_waiters, __ATOMIC_RELAXED) == 0 ||
+            __atomic_exchange_n(&wait->num_waiters, 0, __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+    __atomic_fetch_add(&wait->futex, 1, __ATOMIC_SEQ_CST);
+    if (syscall(SYS_futex, &wait->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0) == -1) {
+        perror("futex failed\n");
+        exit(1);
+    }
+}
@@ -0,0 +1,193 @@
+/*************************************
+* Lab 4
+* Name:
+* Student No:
+* Lab Group:
+*************************************/
+
+#include "shmheap.h"
+
+/*
+Additional helper private functions.
+*/
+uint32_t shmheap_slab_ptr_to_pos(shmheap_memory_handle mem, void *ptr);
+void *shmheap_slab_pos_to_ptr(shmheap_memory_handle mem, uint32_t pos);
+void shmheap_slab_push(shmheap_memory_handle mem, shmheap_slab *slab, uint32_t first, uint32_t last);
+int shmheap_slab_grow(shmheap_memory_handle mem, shmheap_slab *slab);
+void shmheap_slab_flush_cache(shmheap_thread_cache *cache);
+shmheap_thread_cache *shmheap_get_thread_cache(shmheap_memory_handle mem);
+void shmheap_cache_forget_slab(shmheap_memory_handle mem, shmheap_slab *slab);
+
+// header at the start of every slab, keeps the objects 8-byte aligned
+#define SHMHEAP_SLAB_HEADER_SIZE 8
+
+shmheap_slab *shmheap_slab_create(shmheap_memory_handle mem, size_t object_size) {
+
+    // objects must be able to hold the position of the next free object
+    object_size = (object_size + 7) & ~(size_t) 7;
+    if (object_size < 8) {
+        object_size = 8;
+    }
+    if (object_size > SHMHEAP_SLAB_SIZE - SHMHEAP_SLAB_HEADER_SIZE) {
+        return NULL;
+    }
+
+    shmheap_slab *slab = (shmheap_slab *) shmheap_alloc(mem, sizeof(shmheap_slab));
+    if (slab == NULL) {
+        return NULL;
+    }
+    slab->free_stack = 0;
+    slab->slabs = 0;
+    slab->object_size = (uint32_t) object_size;
+    return slab;
+}
+
+void shmheap_slab_destroy(shmheap_memory_handle mem, shmheap_slab *slab) {
+
+    // free every slab, then the slab allocator itself
+    shmheap_cache_forget_slab(mem, slab);
+    uint32_t cur = slab->slabs;
+    while (cur != 0) {
+        void *ptr = shmheap_slab_pos_to_ptr(mem, cur);
+        cur = *(uint32_t *) ptr;
+        shmheap_free(mem, ptr);
+    }
+    shmheap_free(mem, slab);
+}
+
+void *shmheap_slab_alloc(shmheap_memory_handle mem, shmheap_slab *slab) {
+
+    // objects freed by this thread are handed out again without atomics
+    shmheap_thread_cache *cache = shmheap_get_thread_cache(mem);
+    if (cache->slab_count > 0 && cache->slab == (void *) slab - mem.ptr) {
+        uint32_t top = cache->slab_first;
+        cache->slab_first = *(uint32_t *) shmheap_slab_pos_to_ptr(mem, top);
+        cache->slab_count--;
+        return shmheap_slab_pos_to_ptr(mem, top);
+    }
+
+    uint64_t old_stack = __atomic_load_n(&slab->free_stack, __ATOMIC_ACQUIRE);
+    while (1) {
+        uint32_t top = (uint32_t) old_stack;
+
+        // no free object left, carve a new slab
+        if (top == 0) {
+            if (shmheap_slab_grow(mem, slab) != 0) {
+                return NULL;
+            }
+            old_stack = __atomic_load_n(&slab->free_stack, __ATOMIC_ACQUIRE);
+            continue;
+        }
+
+        // the object may be taken by another process in the meantime, in which
+        // case next is garbage, but then the tag has changed and the CAS fails.
+        // Slabs are never freed before the allocator is destroyed, so the read is safe.
+        uint32_t next = __atomic_load_n((uint32_t *) shmheap_slab_pos_to_ptr(mem, top), __ATOMIC_RELAXED);
+        uint64_t new_stack = ((old_stack >> 32) + 1) << 32 | next;
+        if (__atomic_compare_exchange_n(&slab->free_stack, &old_stack, new_stack, 1,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return shmheap_slab_pos_to_ptr(mem, top);
+        }
+    }
+}
+
+void shmheap_slab_free(shmheap_memory_handle mem, shmheap_slab *slab, void *ptr) {
+
+    // (1) the thread caches objects of one slab allocator at a time
+    shmheap_thread_cache *cache = shmheap_get_thread_cache(mem);
+    if (cache->slab != (void *) slab - mem.ptr) {
+        shmheap_slab_flush_cache(cache);
+        cache->slab = (void *) slab - mem.ptr;
+    }
+
+    // (2) a full chain goes to the free stack with a single CAS
+    if (cache->slab_count == SHMHEAP_SLAB_MAGAZINE_SIZE) {
+        shmheap_slab_push(mem, slab, cache->slab_first, cache->slab_last);
+        cache->slab_count = 0;
+    }
+
+    // (3) put the object at the head of the chain
+    uint32_t pos = shmheap_slab_ptr_to_pos(mem, ptr);
+    if (cache->slab_count == 0) {
+        cache->slab_last = pos;
+    }
+    *(uint32_t *) ptr = cache->slab_first;
+    cache->slab_first = pos;
+    cache->slab_count++;
+}
+
+/*
+    Pushes the objects cached by the thread cache onto the free stack of
+    their slab allocator.
+*/
+void shmheap_slab_flush_cache(shmheap_thread_cache *cache) {
+
+    if (cache->slab_count > 0) {
+        shmheap_slab *slab = (shmheap_slab *) (cache->mem.ptr + cache->slab);
+        shmheap_slab_push(cache->mem, slab, cache->slab_first, cache->slab_last);
+    }
+    cache->slab = 0;
+    cache->slab_count = 0;
+}
+
+/*
+    Converts a pointer into the heap to a position in units of 8 bytes.
+*/
+uint32_t shmheap_slab_ptr_to_pos(shmheap_memory_handle mem, void *ptr) {
+    return (uint32_t) ((ptr - mem.ptr) >> 3);
+}
+
+void *shmheap_slab_pos_to_ptr(shmheap_memory_handle mem, uint32_t pos) {
+    return mem.ptr + ((size_t) pos << 3);
+}
+
+/*
+    Pushes the chain of free objects from first to last onto the free stack.
+*/
+void shmheap_slab_push(shmheap_memory_handle mem, shmheap_slab *slab, uint32_t first, uint32_t last) {
+
+    uint32_t *last_next = (uint32_t *) shmheap_slab_pos_to_ptr(mem, last);
+    uint64_t old_stack = __atomic_load_n(&slab->free_stack, __ATOMIC_ACQUIRE);
+    while (1) {
+        __atomic_store_n(last_next, (uint32_t) old_stack, __ATOMIC_RELAXED);
+        uint64_t new_stack = ((old_stack >> 32) + 1) << 32 | first;
+        if (__atomic_compare_exchange_n(&slab->free_stack, &old_stack, new_stack, 1,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+    }
+}
+
+/*
+    Allocates a new slab from the shared heap and pushes its objects onto
+    the free stack. Processes that run out at the same time may each add
+    a slab, which only costs memory.
+    If the heap is full, return -1.
+*/
+int shmheap_slab_grow(shmheap_memory_handle mem, shmheap_slab *slab) {
+
+    void *ptr = shmheap_alloc(mem, SHMHEAP_SLAB_SIZE);
+    if (ptr == NULL) {
+        return -1;
+    }
+
+    // (1) chain the objects of the slab
+    uint32_t step = slab->object_size >> 3;
+    uint32_t first = shmheap_slab_ptr_to_pos(mem, ptr + SHMHEAP_SLAB_HEADER_SIZE);
+    uint32_t count = (SHMHEAP_SLAB_SIZE - SHMHEAP_SLAB_HEADER_SIZE) / slab->object_size;
+    for (uint32_t i = 0; i + 1 < count; i++) {
+        *(uint32_t *) shmheap_slab_pos_to_ptr(mem, first + i * step) = first + (i + 1) * step;
+    }
+
+    // (2) add the slab to the list of slabs
+    uint32_t *next_slab = (uint32_t *) ptr;
+    uint32_t old_slabs = __atomic_load_n(&slab->slabs, __ATOMIC_ACQUIRE);
+    do {
+        *next_slab = old_slabs;
+    } while (!__atomic_compare_exchange_n(&slab->slabs, &old_slabs, shmheap_slab_ptr_to_pos(mem, ptr), 1,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    // (3) hand the objects out
+    shmheap_slab_push(mem, slab, first, first + (count - 1) * step);
+    return 0;
+}
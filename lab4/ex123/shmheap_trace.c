@@ -0,0 +1,112 @@
+/*************************************
+* Lab 4
+* Name:
+* Student No:
+* Lab Group:
+*************************************/
+
+#include "shmheap.h"
+
+/*
+Additional helper private functions.
+*/
+void shmheap_trace_add(shmheap_memory_handle mem, int op, size_t sz, void *ptr);
+pid_t shmheap_get_pid(void);
+
+int shmheap_trace_start(shmheap_memory_handle mem, size_t capacity) {
+
+    shmheap_header *header = (shmheap_header *) mem.ptr;
+    if (header->trace != 0) {
+        return -1;
+    }
+
+    size_t num_records = 2;
+    while (num_records < capacity) {
+        num_records <<= 1;
+    }
+
+    // the ring is allocated before tracing starts, so it is not in the trace
+    shmheap_trace *trace = (shmheap_trace *) shmheap_alloc(mem, sizeof(shmheap_trace) + num_records * sizeof(shmheap_trace_record));
+    if (trace == NULL) {
+        return -1;
+    }
+    memset(trace, 0, sizeof(shmheap_trace) + num_records * sizeof(shmheap_trace_record));
+    trace->mask = num_records - 1;
+    __atomic_store_n(&header->trace, (void *) trace - mem.ptr, __ATOMIC_RELEASE);
+    return 0;
+}
+
+size_t shmheap_trace_dump(shmheap_memory_handle mem, FILE *out) {
+
+    shmheap_header *header = (shmheap_header *) mem.ptr;
+    long pos = __atomic_load_n(&header->trace, __ATOMIC_ACQUIRE);
+    if (pos == 0) {
+        return 0;
+    }
+    shmheap_trace *trace = (shmheap_trace *) (mem.ptr + pos);
+
+    // only the latest mask + 1 records are still in the ring
+    uint64_t end = __atomic_load_n(&trace->next, __ATOMIC_ACQUIRE);
+    uint64_t start = end > trace->mask + 1 ? end - trace->mask - 1 : 0;
+    size_t num_written = 0;
+    for (uint64_t i = start; i < end; i++) {
+
+        // (1) copy the record, unless it is still being written
+        shmheap_trace_record *record = &trace->records[i & trace->mask];
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != i + 1) {
+            continue;
+        }
+        shmheap_trace_record copy = *record;
+
+        // (2) drop the copy if the record was reused while copying it
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&record->sequence, __ATOMIC_RELAXED) != i + 1) {
+            continue;
+        }
+
+        if (fwrite(&copy, sizeof(copy), 1, out) != 1) {
+            perror("fwrite failed\n");
+            exit(1);
+        }
+        num_written++;
+    }
+    return num_written;
+}
+
+void shmheap_trace_stop(shmheap_memory_handle mem) {
+
+    shmheap_header *header = (shmheap_header *) mem.ptr;
+    long pos = __atomic_exchange_n(&header->trace, 0, __ATOMIC_ACQ_REL);
+    if (pos != 0) {
+        shmheap_free(mem, mem.ptr + pos);
+    }
+}
+
+/*
+    Records a call to shmheap_alloc or shmheap_free of the object at ptr
+    in the trace of the heap. A record is claimed by bumping next, and
+    marked as complete by storing its sequence last.
+*/
+void shmheap_trace_add(shmheap_memory_handle mem, int op, size_t sz, void *ptr) {
+
+    shmheap_header *header = (shmheap_header *) mem.ptr;
+    long pos = __atomic_load_n(&header->trace, __ATOMIC_ACQUIRE);
+    if (pos == 0) {
+        return;
+    }
+    shmheap_trace *trace = (shmheap_trace *) (mem.ptr + pos);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t i = __atomic_fetch_add(&trace->next, 1, __ATOMIC_RELAXED);
+    shmheap_trace_record *record = &trace->records[i & trace->mask];
+    __atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->timestamp = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    record->offset = ptr == NULL ? 0 : ptr - mem.ptr;
+    record->size = sz;
+    record->pid = shmheap_get_pid();
+    record->op = op;
+    __atomic_store_n(&record->sequence, i + 1, __ATOMIC_RELEASE);
+}
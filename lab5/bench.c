@@ -0,0 +1,580 @@
+/**
+ * This benchmarks zc_io.
+ *
+ * rwlock: has `num_readers` threads read a file through zc_read_start in a
+ *         loop while one thread keeps writing to it, and reports the read
+ *         throughput and how long the writer waits in zc_write_start.
+ * writeback: writes small chunks at random offsets of a large file under
+ *         each zc_set_writeback setting, and reports how long each write
+ *         takes and how long the zc_flush after them takes.
+ * append: appends records of `record_size` bytes to a new file, with
+ *         write-back left to zc_flush, and reports the append throughput.
+ * appenders: has `num_threads` threads append records to one file, first
+ *         with zc_lseek and zc_write_start then with zc_append_reserve,
+ *         and reports the append throughput of each.
+ * appendlimit: appends records with zc_append_reserve until the file
+ *         reaches a limit on its size, lifts the limit and appends
+ *         `num_records` more, and checks that every record that got in
+ *         follows the one before it, with no bytes between them.
+ * pread:  has `num_threads` threads read random pages of one file, first
+ *         with zc_lseek and zc_read_start then with zc_pread_start, and
+ *         reports the read throughput and how many reads got other bytes
+ *         than asked for.
+ * copy:   copies a file of `size_mb` MB, first with one memcpy between
+ *         whole-file mappings then with zc_copyfile, each in a child
+ *         process, and reports the wall time and peak RSS of each.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "zc_io.h"
+
+static double now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+// creates a file of size bytes at path, filled with a repeating pattern
+static void make_file(const char *path, size_t size) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror("fopen failed\n");
+    exit(1);
+  }
+  // a whole number of patterns, so that every block starts with 'a'
+  static char block[26 * 2520];
+  for (size_t i = 0; i < sizeof(block); i++) {
+    block[i] = 'a' + i % 26;
+  }
+  for (size_t i = 0; i < size; i += sizeof(block)) {
+    fwrite(block, 1, size - i < sizeof(block) ? size - i : sizeof(block), f);
+  }
+
+  // so that no benchmark pays for writing back the pattern
+  fflush(f);
+  fsync(fileno(f));
+  fclose(f);
+}
+
+#define RWLOCK_FILE_SIZE (16 << 20)
+#define RWLOCK_READ_SIZE 4096
+#define RWLOCK_WRITE_SIZE 64
+#define RWLOCK_DURATION_NS 2e9
+#define RWLOCK_WRITE_INTERVAL_US 1000
+
+static zc_file *rwlock_file;
+static volatile int rwlock_stop;
+
+static void *rwlock_reader(void *arg) {
+  long *num_reads = (long *) arg;
+  unsigned sum = 0;
+  while (!rwlock_stop) {
+    size_t size = RWLOCK_READ_SIZE;
+    const char *ptr = zc_read_start(rwlock_file, &size);
+    if (ptr == NULL) {
+      // at the end of the file, start over
+      zc_lseek(rwlock_file, 0, SEEK_SET);
+      continue;
+    }
+    for (size_t i = 0; i < size; i += 64) {
+      sum += ptr[i];
+    }
+    zc_read_end(rwlock_file);
+    (*num_reads)++;
+  }
+  return (void *) (long) sum;
+}
+
+static int bench_rwlock(int num_readers) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/zc_bench_%d", getpid());
+  make_file(path, RWLOCK_FILE_SIZE);
+  rwlock_file = zc_open(path);
+  if (rwlock_file == NULL) {
+    return 1;
+  }
+
+  pthread_t *readers = malloc(sizeof(pthread_t) * num_readers);
+  long *num_reads = calloc(num_readers, sizeof(long));
+  const size_t max_writes = RWLOCK_DURATION_NS / 1e3 / RWLOCK_WRITE_INTERVAL_US;
+  double *waits = malloc(sizeof(double) * max_writes);
+  rwlock_stop = 0;
+  for (int i = 0; i < num_readers; i++) {
+    pthread_create(&readers[i], NULL, rwlock_reader, &num_reads[i]);
+  }
+
+  // write every RWLOCK_WRITE_INTERVAL_US until the time is up, the
+  // readers stop when it is, so a starved writer gets in eventually
+  size_t num_writes = 0;
+  const double start = now_ns();
+  while (num_writes < max_writes && now_ns() - start < RWLOCK_DURATION_NS) {
+    const double t = now_ns();
+    char *ptr = zc_write_start(rwlock_file, RWLOCK_WRITE_SIZE);
+    waits[num_writes++] = now_ns() - t;
+    if (ptr != NULL) {
+      memset(ptr, 'w', RWLOCK_WRITE_SIZE);
+    }
+    zc_write_end(rwlock_file);
+    if (now_ns() - start >= RWLOCK_DURATION_NS) {
+      break;
+    }
+    usleep(RWLOCK_WRITE_INTERVAL_US);
+  }
+  rwlock_stop = 1;
+  const double elapsed = now_ns() - start;
+
+  long total_reads = 0;
+  for (int i = 0; i < num_readers; i++) {
+    pthread_join(readers[i], NULL);
+    total_reads += num_reads[i];
+  }
+
+  qsort(waits, num_writes, sizeof(double), compare_doubles);
+  printf("%d readers: %.2f Mreads/s, %zu writes, writer wait p50 %.1f us, p99 %.1f us, max %.1f us\n",
+         num_readers, total_reads * 1e3 / elapsed, num_writes, waits[num_writes / 2] / 1e3,
+         waits[num_writes * 99 / 100] / 1e3, waits[num_writes - 1] / 1e3);
+
+  free(waits);
+  free(num_reads);
+  free(readers);
+  zc_close(rwlock_file);
+  unlink(path);
+  return 0;
+}
+
+#define WRITEBACK_FILE_SIZE (256 << 20)
+#define WRITEBACK_WRITE_SIZE 100
+#define WRITEBACK_ASYNC_BYTES (1 << 20)
+#define WRITEBACK_INTERVAL_MS 100
+
+static const char *writeback_names[] = {"sync", "none", "async", "background", "explicit"};
+
+static void bench_writeback_one(const char *path, zc_writeback writeback, int num_writes) {
+  zc_file *file = zc_open(path);
+  if (file == NULL) {
+    exit(1);
+  }
+  long param = writeback == ZC_WRITEBACK_ASYNC ? WRITEBACK_ASYNC_BYTES : WRITEBACK_INTERVAL_MS;
+  if (zc_set_writeback(file, writeback, param) != 0) {
+    exit(1);
+  }
+
+  double *latencies = malloc(sizeof(double) * num_writes);
+  srand(1);
+  for (int i = 0; i < num_writes; i++) {
+    zc_lseek(file, rand() % (WRITEBACK_FILE_SIZE - WRITEBACK_WRITE_SIZE), SEEK_SET);
+    const double t = now_ns();
+    char *ptr = zc_write_start(file, WRITEBACK_WRITE_SIZE);
+    if (ptr != NULL) {
+      memset(ptr, 'w', WRITEBACK_WRITE_SIZE);
+    }
+    zc_write_end(file);
+    latencies[i] = now_ns() - t;
+  }
+
+  const double t = now_ns();
+  zc_flush(file);
+  const double flush = now_ns() - t;
+
+  qsort(latencies, num_writes, sizeof(double), compare_doubles);
+  printf("%-10s %d writes: p50 %.1f us, p99 %.1f us, max %.1f us, then zc_flush %.1f ms\n",
+         writeback_names[writeback], num_writes, latencies[num_writes / 2] / 1e3,
+         latencies[num_writes * 99 / 100] / 1e3, latencies[num_writes - 1] / 1e3, flush / 1e6);
+
+  free(latencies);
+  zc_close(file);
+}
+
+static int bench_writeback(const char *name, int num_writes) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/zc_bench_%d", getpid());
+  make_file(path, WRITEBACK_FILE_SIZE);
+
+  for (int i = 0; i < (int) (sizeof(writeback_names) / sizeof(writeback_names[0])); i++) {
+    if (name == NULL || strcmp(name, writeback_names[i]) == 0) {
+      bench_writeback_one(path, (zc_writeback) i, num_writes);
+    }
+  }
+
+  unlink(path);
+  return 0;
+}
+
+static int bench_append(int record_size, int num_records) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/zc_bench_%d", getpid());
+  unlink(path);
+  zc_file *file = zc_open(path);
+  if (file == NULL) {
+    return 1;
+  }
+
+  // only the growth of the file is timed, not its write-back
+  if (zc_set_writeback(file, ZC_WRITEBACK_EXPLICIT, 0) != 0) {
+    return 1;
+  }
+  char *record = malloc(record_size);
+  memset(record, 'r', record_size);
+
+  const double start = now_ns();
+  for (int i = 0; i < num_records; i++) {
+    char *ptr = zc_write_start(file, record_size);
+    if (ptr != NULL) {
+      memcpy(ptr, record, record_size);
+    }
+    zc_write_end(file);
+  }
+  const double elapsed = now_ns() - start;
+  printf("%d records of %d bytes: %.0f records/s, %.1f MB/s\n", num_records, record_size,
+         num_records * 1e9 / elapsed, (double) num_records * record_size * 1e3 / elapsed);
+
+  free(record);
+  zc_close(file);
+
+  // the room reserved for more records is gone once the file is closed
+  struct stat statbuf;
+  if (stat(path, &statbuf) != 0 || statbuf.st_size != (off_t) num_records * record_size) {
+    printf("file has %ld bytes after zc_close\n", (long) statbuf.st_size);
+    return 1;
+  }
+  unlink(path);
+  return 0;
+}
+
+#define APPENDERS_RECORD_SIZE 100
+
+static zc_file *appenders_file;
+static int appenders_num_records;
+static int appenders_use_reserve;
+
+static void *appenders_appender(void *arg) {
+  char c = 'a' + (long) arg % 26;
+  for (int i = 0; i < appenders_num_records; i++) {
+    if (appenders_use_reserve) {
+      char *ptr = zc_append_reserve(appenders_file, APPENDERS_RECORD_SIZE);
+      memset(ptr, c, APPENDERS_RECORD_SIZE);
+      zc_append_commit(appenders_file, ptr, APPENDERS_RECORD_SIZE);
+    } else {
+      // the seek and the write are not atomic together, so a record may
+      // land on top of another one here, only the time is of interest
+      zc_lseek(appenders_file, 0, SEEK_END);
+      char *ptr = zc_write_start(appenders_file, APPENDERS_RECORD_SIZE);
+      memset(ptr, c, APPENDERS_RECORD_SIZE);
+      zc_write_end(appenders_file);
+    }
+  }
+  return NULL;
+}
+
+static int bench_appenders(int num_threads, int num_records) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/zc_bench_%d", getpid());
+  pthread_t *appenders = malloc(sizeof(pthread_t) * num_threads);
+  appenders_num_records = num_records;
+
+  for (appenders_use_reserve = 0; appenders_use_reserve <= 1; appenders_use_reserve++) {
+    unlink(path);
+    appenders_file = zc_open(path);
+    if (appenders_file == NULL || zc_set_writeback(appenders_file, ZC_WRITEBACK_EXPLICIT, 0) != 0) {
+      return 1;
+    }
+
+    const double start = now_ns();
+    for (long i = 0; i < num_threads; i++) {
+      pthread_create(&appenders[i], NULL, appenders_appender, (void *) i);
+    }
+    for (int i = 0; i < num_threads; i++) {
+      pthread_join(appenders[i], NULL);
+    }
+    const double elapsed = now_ns() - start;
+    printf("%s: %d threads, %.0f records/s\n", appenders_use_reserve ? "zc_append_reserve" : "zc_write_start",
+           num_threads, (double) num_threads * num_records * 1e9 / elapsed);
+
+    // every reserved record must have been written, whole
+    if (appenders_use_reserve) {
+      size_t size = (size_t) num_threads * num_records * APPENDERS_RECORD_SIZE;
+      zc_lseek(appenders_file, 0, SEEK_SET);
+      const char *ptr = zc_read_start(appenders_file, &size);
+      for (size_t i = 0; ptr != NULL && i < size; i++) {
+        if (ptr[i] == '\0' || ptr[i] != ptr[i - i % APPENDERS_RECORD_SIZE]) {
+          printf("record at %zu is torn\n", i - i % APPENDERS_RECORD_SIZE);
+          return 1;
+        }
+      }
+      zc_read_end(appenders_file);
+    }
+    zc_close(appenders_file);
+  }
+
+  free(appenders);
+  unlink(path);
+  return 0;
+}
+
+#define APPEND_LIMIT_SIZE (1 << 20)
+
+// appends the record numbered index, filled with a letter of its own
+static int append_record(zc_file *file, int index) {
+  char *ptr = zc_append_reserve(file, APPENDERS_RECORD_SIZE);
+  if (ptr == NULL) {
+    return -1;
+  }
+  memset(ptr, 'a' + index % 26, APPENDERS_RECORD_SIZE);
+  zc_append_commit(file, ptr, APPENDERS_RECORD_SIZE);
+  return 0;
+}
+
+static int bench_append_limit(int num_records) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/zc_bench_%d", getpid());
+  unlink(path);
+  zc_file *file = zc_open(path);
+  if (file == NULL || zc_set_writeback(file, ZC_WRITEBACK_EXPLICIT, 0) != 0) {
+    return 1;
+  }
+
+  // growing the file past the limit fails with EFBIG instead of a signal
+  struct rlimit old_limit, limit;
+  getrlimit(RLIMIT_FSIZE, &old_limit);
+  limit = old_limit;
+  limit.rlim_cur = APPEND_LIMIT_SIZE;
+  signal(SIGXFSZ, SIG_IGN);
+  setrlimit(RLIMIT_FSIZE, &limit);
+  int num_fitting = 0;
+  while (num_fitting <= APPEND_LIMIT_SIZE / APPENDERS_RECORD_SIZE && append_record(file, num_fitting) == 0) {
+    num_fitting++;
+  }
+  setrlimit(RLIMIT_FSIZE, &old_limit);
+  if (num_fitting > APPEND_LIMIT_SIZE / APPENDERS_RECORD_SIZE) {
+    printf("the file grew past the limit\n");
+    return 1;
+  }
+
+  // the failed append must have given its bytes back
+  for (int i = 0; i < num_records; i++) {
+    if (append_record(file, num_fitting + i) != 0) {
+      printf("append %d after the limit was lifted failed\n", i);
+      return 1;
+    }
+  }
+  size_t size = (size_t) (num_fitting + num_records) * APPENDERS_RECORD_SIZE;
+  zc_lseek(file, 0, SEEK_SET);
+  const char *ptr = zc_read_start(file, &size);
+  if (ptr == NULL || size != (size_t) (num_fitting + num_records) * APPENDERS_RECORD_SIZE) {
+    printf("file has %zu bytes, not %d records\n", size, num_fitting + num_records);
+    return 1;
+  }
+  for (size_t i = 0; i < size; i++) {
+    if (ptr[i] != 'a' + (int) (i / APPENDERS_RECORD_SIZE) % 26) {
+      printf("record at %zu is out of place\n", i - i % APPENDERS_RECORD_SIZE);
+      return 1;
+    }
+  }
+  zc_read_end(file);
+  zc_close(file);
+
+  printf("%d records fit under the limit, %d appended after it was lifted\n", num_fitting, num_records);
+  unlink(path);
+  return 0;
+}
+
+#define PREAD_FILE_SIZE (64 << 20)
+#define PREAD_READ_SIZE 4096
+#define PREAD_DURATION_NS 1e9
+
+static zc_file *pread_file;
+static volatile int pread_stop;
+static int pread_use_offset;
+
+// counts reads in [0] and reads of the wrong bytes in [1]
+static void *pread_reader(void *arg) {
+  long *counts = (long *) arg;
+  unsigned seed = (unsigned) (long) &counts;
+  while (!pread_stop) {
+    long offset = rand_r(&seed) % (PREAD_FILE_SIZE - PREAD_READ_SIZE);
+    size_t size = PREAD_READ_SIZE;
+    const char *ptr;
+    if (pread_use_offset) {
+      ptr = zc_pread_start(pread_file, offset, &size);
+    } else {
+      // another thread may seek between the two calls
+      zc_lseek(pread_file, offset, SEEK_SET);
+      ptr = zc_read_start(pread_file, &size);
+    }
+    if (ptr == NULL) {
+      continue;
+    }
+
+    // the file holds a repeating pattern, see make_file
+    if (ptr[0] != 'a' + offset % 26) {
+      counts[1]++;
+    }
+    zc_read_end(pread_file);
+    counts[0]++;
+  }
+  return NULL;
+}
+
+static int bench_pread(int num_threads) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/zc_bench_%d", getpid());
+  make_file(path, PREAD_FILE_SIZE);
+  pread_file = zc_open(path);
+  if (pread_file == NULL) {
+    return 1;
+  }
+
+  pthread_t *readers = malloc(sizeof(pthread_t) * num_threads);
+  long (*counts)[2] = malloc(sizeof(long[2]) * num_threads);
+  for (pread_use_offset = 0; pread_use_offset <= 1; pread_use_offset++) {
+    pread_stop = 0;
+    for (int i = 0; i < num_threads; i++) {
+      counts[i][0] = counts[i][1] = 0;
+      pthread_create(&readers[i], NULL, pread_reader, counts[i]);
+    }
+    usleep(PREAD_DURATION_NS / 1e3);
+    pread_stop = 1;
+
+    long num_reads = 0, num_wrong = 0;
+    for (int i = 0; i < num_threads; i++) {
+      pthread_join(readers[i], NULL);
+      num_reads += counts[i][0];
+      num_wrong += counts[i][1];
+    }
+    printf("%s: %d threads, %.2f Mreads/s, %ld of %ld reads at the wrong offset\n",
+           pread_use_offset ? "zc_pread_start" : "zc_lseek + zc_read_start", num_threads,
+           num_reads * 1e3 / PREAD_DURATION_NS, num_wrong, num_reads);
+  }
+
+  free(counts);
+  free(readers);
+  zc_close(pread_file);
+  unlink(path);
+  return 0;
+}
+
+// copies source to dest the way zc_copyfile used to, with one memcpy
+// between mappings of the whole files
+static int copy_with_memcpy(const char *source, const char *dest) {
+  unlink(dest);
+  zc_file *source_file = zc_open(source);
+  zc_file *dest_file = zc_open(dest);
+  if (source_file == NULL || dest_file == NULL) {
+    return 1;
+  }
+  size_t size = (size_t) zc_lseek(source_file, 0, SEEK_END);
+  zc_lseek(source_file, 0, SEEK_SET);
+  const char *read_ptr = zc_read_start(source_file, &size);
+  char *write_ptr = zc_write_start(dest_file, size);
+  memcpy(write_ptr, read_ptr, size);
+  zc_read_end(source_file);
+  zc_write_end(dest_file);
+  zc_close(source_file);
+  zc_close(dest_file);
+  return 0;
+}
+
+// checks that the files at path1 and path2 hold the same bytes
+static int files_are_equal(const char *path1, const char *path2) {
+  FILE *f1 = fopen(path1, "r");
+  FILE *f2 = fopen(path2, "r");
+  int is_equal = f1 != NULL && f2 != NULL;
+  static char block1[1 << 16], block2[1 << 16];
+  while (is_equal) {
+    size_t n1 = fread(block1, 1, sizeof(block1), f1);
+    size_t n2 = fread(block2, 1, sizeof(block2), f2);
+    is_equal = n1 == n2 && memcmp(block1, block2, n1) == 0;
+    if (n1 == 0) {
+      break;
+    }
+  }
+  if (f1 != NULL) {
+    fclose(f1);
+  }
+  if (f2 != NULL) {
+    fclose(f2);
+  }
+  return is_equal;
+}
+
+static int bench_copy(long size_mb) {
+  char source[64], dest[64];
+  snprintf(source, sizeof(source), "/tmp/zc_bench_%d", getpid());
+  snprintf(dest, sizeof(dest), "/tmp/zc_bench_%d_copy", getpid());
+  make_file(source, (size_t) size_mb << 20);
+
+  for (int use_copyfile = 0; use_copyfile <= 1; use_copyfile++) {
+    // each copy runs in a child, so that it has a peak RSS of its own
+    const double start = now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+      _exit(use_copyfile ? zc_copyfile(source, dest) != 0 : copy_with_memcpy(source, dest));
+    }
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    const double elapsed = now_ns() - start;
+
+    int is_copied = WIFEXITED(status) && WEXITSTATUS(status) == 0 && files_are_equal(source, dest);
+    printf("%-11s %ld MB: %.2f s, peak RSS %.1f MB%s\n", use_copyfile ? "zc_copyfile" : "memcpy", size_mb,
+           elapsed / 1e9, usage.ru_maxrss / 1024.0, is_copied ? "" : ", failed");
+    unlink(dest);
+  }
+
+  unlink(source);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    printf("usage: %s rwlock [num_readers]\n", argv[0]);
+    printf("       %s writeback [sync|none|async|background|explicit] [num_writes]\n", argv[0]);
+    printf("       %s append [record_size] [num_records]\n", argv[0]);
+    printf("       %s appenders [num_threads] [num_records]\n", argv[0]);
+    printf("       %s appendlimit [num_records]\n", argv[0]);
+    printf("       %s pread [num_threads]\n", argv[0]);
+    printf("       %s copy [size_mb]\n", argv[0]);
+    return 1;
+  }
+
+  if (strcmp(argv[1], "rwlock") == 0) {
+    return bench_rwlock(argc > 2 ? atoi(argv[2]) : 32);
+  }
+  if (strcmp(argv[1], "writeback") == 0) {
+    return bench_writeback(argc > 2 ? argv[2] : NULL, argc > 3 ? atoi(argv[3]) : 2000);
+  }
+  if (strcmp(argv[1], "append") == 0) {
+    return bench_append(argc > 2 ? atoi(argv[2]) : 100, argc > 3 ? atoi(argv[3]) : 1000000);
+  }
+  if (strcmp(argv[1], "appenders") == 0) {
+    return bench_appenders(argc > 2 ? atoi(argv[2]) : 8, argc > 3 ? atoi(argv[3]) : 100000);
+  }
+  if (strcmp(argv[1], "appendlimit") == 0) {
+    return bench_append_limit(argc > 2 ? atoi(argv[2]) : 1000);
+  }
+  if (strcmp(argv[1], "pread") == 0) {
+    return bench_pread(argc > 2 ? atoi(argv[2]) : 8);
+  }
+  if (strcmp(argv[1], "copy") == 0) {
+    return bench_copy(argc > 2 ? atol(argv[2]) : 1024);
+  }
+  printf("unknown benchmark: %s\n", argv[1]);
+  return 1;
+}
@@ -0,0 +1,236 @@
+/**
+ * This benchmarks the page-wise synchronisation of zc_io.
+ *
+ * handoff: has one thread hold a write on the first page of a file while
+ *          another thread waits to read it, and reports how long the reader
+ *          takes to get the page once the writer lets go of it.
+ * readers: has many threads hold a read on a file at once, and reports
+ *          how long another thread takes to start and end a read of it.
+ * small_reads: reads single pages at random offsets of a huge sparse file,
+ *          and reports how long each read start and end takes.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "zc_io.h"
+
+static double now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+// creates a file of size bytes at path, filled with a repeating pattern
+static void make_file(const char *path, size_t size) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror("fopen failed\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < size; i++) {
+    fputc('a' + i % 26, f);
+  }
+  fclose(f);
+}
+
+#define HANDOFF_FILE_SIZE (1 << 20)
+#define HANDOFF_HOLD_US 200
+
+static zc_file *handoff_file;
+static pthread_barrier_t handoff_barrier;
+static volatile double handoff_release;
+
+static void *handoff_reader(void *arg) {
+  double *handoffs = (double *) arg;
+  for (int i = 0; handoffs[i] >= 0; i++) {
+    // wait until the writer holds the page, then queue up behind it
+    pthread_barrier_wait(&handoff_barrier);
+    zc_lseek(handoff_file, 0, SEEK_SET);
+    size_t size = 1;
+    const char *ptr = zc_read_start(handoff_file, &size);
+    handoffs[i] = now_ns() - handoff_release;
+    if (ptr != NULL) {
+      zc_read_end(handoff_file);
+    }
+    pthread_barrier_wait(&handoff_barrier);
+  }
+  return NULL;
+}
+
+static int bench_handoff(int num_rounds) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/zc_bench_%d", getpid());
+  make_file(path, HANDOFF_FILE_SIZE);
+  handoff_file = zc_open(path);
+  if (handoff_file == NULL) {
+    return 1;
+  }
+
+  // the reader stops at the first negative entry
+  double *handoffs = malloc(sizeof(double) * (num_rounds + 1));
+  for (int i = 0; i < num_rounds; i++) {
+    handoffs[i] = 0;
+  }
+  handoffs[num_rounds] = -1;
+  pthread_barrier_init(&handoff_barrier, NULL, 2);
+  pthread_t reader;
+  pthread_create(&reader, NULL, handoff_reader, handoffs);
+
+  for (int i = 0; i < num_rounds; i++) {
+    zc_lseek(handoff_file, 0, SEEK_SET);
+    zc_write_start(handoff_file, 1);
+    pthread_barrier_wait(&handoff_barrier);
+
+    // give the reader time to block on the page
+    usleep(HANDOFF_HOLD_US);
+    handoff_release = now_ns();
+    zc_write_end(handoff_file);
+    pthread_barrier_wait(&handoff_barrier);
+  }
+  pthread_join(reader, NULL);
+
+  qsort(handoffs, num_rounds, sizeof(double), compare_doubles);
+  printf("%d handoffs: p50 %.1f us, p99 %.1f us, max %.1f us\n", num_rounds, handoffs[num_rounds / 2] / 1e3,
+         handoffs[num_rounds * 99 / 100] / 1e3, handoffs[num_rounds - 1] / 1e3);
+
+  pthread_barrier_destroy(&handoff_barrier);
+  free(handoffs);
+  zc_close(handoff_file);
+  unlink(path);
+  return 0;
+}
+
+#define READERS_FILE_SIZE (1 << 20)
+
+static zc_file *readers_file;
+static pthread_barrier_t readers_barrier;
+
+static void *readers_holder(void *arg) {
+  (void) arg;
+  zc_lseek(readers_file, 0, SEEK_SET);
+  size_t size = 1;
+  const char *ptr = zc_read_start(readers_file, &size);
+
+  // keep the read until the timed thread is done
+  pthread_barrier_wait(&readers_barrier);
+  pthread_barrier_wait(&readers_barrier);
+  if (ptr != NULL) {
+    zc_read_end(readers_file);
+  }
+  return NULL;
+}
+
+static int bench_readers(int num_threads, int num_reads) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/zc_bench_%d", getpid());
+  make_file(path, READERS_FILE_SIZE);
+  readers_file = zc_open(path);
+  if (readers_file == NULL) {
+    return 1;
+  }
+
+  pthread_barrier_init(&readers_barrier, NULL, num_threads + 1);
+  pthread_t *holders = malloc(sizeof(pthread_t) * num_threads);
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(&holders[i], NULL, readers_holder, NULL);
+  }
+  pthread_barrier_wait(&readers_barrier);
+
+  double start = now_ns();
+  for (int i = 0; i < num_reads; i++) {
+    zc_lseek(readers_file, 0, SEEK_SET);
+    size_t size = 1;
+    if (zc_read_start(readers_file, &size) != NULL) {
+      zc_read_end(readers_file);
+    }
+  }
+  double elapsed = now_ns() - start;
+  printf("%d reads with %d reads held: %.1f ns per read\n", num_reads, num_threads, elapsed / num_reads);
+
+  pthread_barrier_wait(&readers_barrier);
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(holders[i], NULL);
+  }
+  pthread_barrier_destroy(&readers_barrier);
+  free(holders);
+  zc_close(readers_file);
+  unlink(path);
+  return 0;
+}
+
+#define SMALL_READS_SIZE 4096
+
+static int bench_small_reads(long file_gb, int num_reads) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/zc_bench_%d", getpid());
+
+  // a sparse file takes no disk space, however large it is
+  long file_size = file_gb << 30;
+  int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, S_IRWXU);
+  if (fd == -1 || ftruncate(fd, file_size) != 0) {
+    perror("ftruncate failed\n");
+    exit(1);
+  }
+  close(fd);
+
+  double open_start = now_ns();
+  zc_file *file = zc_open(path);
+  if (file == NULL) {
+    return 1;
+  }
+  double open_elapsed = now_ns() - open_start;
+
+  // the pages are not touched, so only the bookkeeping is timed
+  srand(1);
+  double start = now_ns();
+  for (int i = 0; i < num_reads; i++) {
+    long offset = ((long) rand() * RAND_MAX + rand()) % (file_size - SMALL_READS_SIZE);
+    zc_lseek(file, offset, SEEK_SET);
+    size_t size = SMALL_READS_SIZE;
+    if (zc_read_start(file, &size) != NULL) {
+      zc_read_end(file);
+    }
+  }
+  double elapsed = now_ns() - start;
+  printf("%ld GB file: open %.1f ms, %d reads of %d bytes: %.1f ns per read\n", file_gb, open_elapsed / 1e6,
+         num_reads, SMALL_READS_SIZE, elapsed / num_reads);
+
+  zc_close(file);
+  unlink(path);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    printf("usage: %s handoff [num_rounds]\n", argv[0]);
+    printf("       %s readers [num_threads] [num_reads]\n", argv[0]);
+    printf("       %s small_reads [file_gb] [num_reads]\n", argv[0]);
+    return 1;
+  }
+
+  if (strcmp(argv[1], "handoff") == 0) {
+    return bench_handoff(argc > 2 ? atoi(argv[2]) : 1000);
+  }
+  if (strcmp(argv[1], "readers") == 0) {
+    return bench_readers(argc > 2 ? atoi(argv[2]) : 500, argc > 3 ? atoi(argv[3]) : 100000);
+  }
+  if (strcmp(argv[1], "small_reads") == 0) {
+    return bench_small_reads(argc > 2 ? atol(argv[2]) : 10, argc > 3 ? atoi(argv[3]) : 100000);
+  }
+  printf("unknown benchmark: %s\n", argv[1]);
+  return 1;
+}
@@ -1,7 +1,8 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
-#include <semaphore.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -18,41 +19,70 @@
 #define IF_TRUE_THEN_FAILED_TO_WRITE(cond, msg) do {if (cond) {perror(msg); return NULL;}} while(0)
 #define IF_TRUE_THEN_FAILED_TO_LSEEK(cond, msg) do {if (cond) {perror(msg); return (off_t) -1;}} while(0)
 
-typedef enum {INIT_COUNT, INCREASE_COUNT, DECREASE_COUNT} update_readers_mode;
 typedef enum {READ, WRITE} mode;
 
+// number of ranges that a thread can hold at the same time, over all files
+#define MAX_RANGES_PER_THREAD 8
+
+// least address space reserved for the mapping of a file, so that it
+// can grow in place while other threads use pointers into it
+#define MIN_RESERVED_SIZE (1L << 30)
+
+// A range of pages locked by a thread, from zc_read_start or
+// zc_write_start until the matching end call. Each thread keeps its
+// entries in thread local storage, so locking a range allocates nothing.
 typedef struct zc_access_info zc_access_info;
 struct zc_access_info {
-  // pointer to next entry
+  // pointers to next and previous entries
   zc_access_info *next;
-  // thred ID
-  pid_t thread_id;
+  zc_access_info *prev;
+  // file whose pages are locked, NULL if the entry is unused
+  zc_file *file;
   // starting index for the access
   int start_index;
   // ending index for the access
   int end_index;
+  // reads share their pages with other reads, writes do not
+  mode mode;
+};
 
+// A thread waiting for a range of pages that another thread has locked.
+typedef struct zc_range_waiter zc_range_waiter;
+struct zc_range_waiter {
+  // pointer to next entry
+  zc_range_waiter *next;
+  // pages that the thread waits for
+  int start_index;
+  int end_index;
+  // signalled when a range overlapping these pages is unlocked
+  pthread_cond_t cond;
 };
 
+// entries of the calling thread, one per range that it holds
+static __thread zc_access_info thread_access_infos[MAX_RANGES_PER_THREAD];
 
 // The zc_file struct is analogous to the FILE struct that you get from fopen.
 struct zc_file {
   // pointer to the virtual memory space
   void *ptr;
+  // bytes of address space reserved at ptr, and the bytes at its start
+  // that map the file. Both are multiples of the page size
+  long reserved;
+  long mapped;
   // offset from the start of the virtual memory
   long offset;
   // total size of the file
   long size;
   // file descriptor to the opened file
   int fd;
-  // mutex for access to the memory space
-  sem_t *buffer_mutexes;
-  // mutex for modifying the number of readers
-  sem_t try_to_access_buffer_mutex;
-  // number of readers
-  int *num_readers;
-  // linked list containing access_info
+  // mutex for the locked ranges, the waiters and the offset
+  pthread_mutex_t range_mutex;
+  // doubly linked list containing access_info, one entry per locked range
   zc_access_info* head_ptr;
+  // number of entries in head_ptr that are writes
+  int num_writes;
+  // linked list of threads waiting for a range
+  zc_range_waiter *waiters;
 
 };
 
@@ -62,16 +92,16 @@ long get_file_size(zc_file *file);
 int init_sync_resources(zc_file *file);
 int get_index(long num);
 int calc_num_pages(zc_file *file);
-int add_access_info_entry(zc_file *file, int start_index, int end_index);
-int update_num_readers(zc_file *file, int start_index, int end_index, update_readers_mode mode);
-int unlock_mutexes(zc_file *file, int start_index, int end_index, int* locked_mutexes);
-int wait_try_to_access_buffer_mutex(zc_file *file);
-int try_to_get_mutexes(zc_file *file, int start_index, int end_index, int *locked_mutexes, int *able_to_get_mutexes, mode mode);
-int post_try_to_access_buffer_mutex(zc_file *file);
+int add_access_info_entry(zc_file *file, int start_index, int end_index, mode mode);
+int lock_range_mutex(zc_file *file);
+int unlock_range_mutex(zc_file *file);
+int is_range_free(zc_file *file, int start_index, int end_index, mode mode);
+int wait_for_range(zc_file *file, zc_range_waiter *waiter, int start_index, int end_index);
+int wake_range_waiters(zc_file *file, int start_index, int end_index);
 void set_start_and_end_index(zc_file *file, size_t* size, int *start_index, int *end_index);
+void set_write_start_and_end_index(zc_file *file, size_t size, int *start_index, int *end_index);
+zc_access_info *get_access_info_entry(zc_file *file);
 zc_access_info *remove_access_info_entry(zc_file *file);
-int update_sync_resources(zc_file *file, long size);
-int update_access_info_entry(zc_file *file, int end_index);
 int update_file_size(zc_file *file, long new_size, int fill_with_null);
 
 /**************
@@ -105,6 +135,8 @@ zc_file *zc_open(const char *path) {
 
   // map file into virtual address space
   file_ptr->ptr = NULL;
+  file_ptr->reserved = 0;
+  file_ptr->mapped = 0;
   if (update_ptr_to_virtual_address(file_ptr, size) == -1) {
     return NULL;
   }
@@ -115,8 +147,10 @@ zc_file *zc_open(const char *path) {
     return NULL;
   }
   
-  // initialise head_ptr
+  // initialise head_ptr and waiters
   file_ptr->head_ptr = NULL;
+  file_ptr->num_writes = 0;
+  file_ptr->waiters = NULL;
 
   return file_ptr;
 }
@@ -129,8 +163,8 @@ int zc_close(zc_file *file) {
     return -1;
   }
   
-  // unmap file from memory
-  if (munmap(file->ptr, file->size) != 0) {
+  // unmap file from memory, with the address space reserved for it
+  if (file->ptr != NULL && munmap(file->ptr, file->reserved) != 0) {
       perror("munmap failed\n");
       return -1;
   }
@@ -141,43 +175,13 @@ int zc_close(zc_file *file) {
    return -1;
   }
 
-  // destroy semaphores
-  int num_pages = calc_num_pages(file);
-  for (int i = 0; i < num_pages; i++) {
-    if(sem_destroy(&(file->buffer_mutexes[i])) != 0) {
-      perror("sem_destroy failed\n");
-      return -1;
-    }
-  }
-  if (sem_destroy(&(file->try_to_access_buffer_mutex)) != 0) {
-    perror("sem_destroy failed\n");
+  // destroy mutex
+  if (pthread_mutex_destroy(&(file->range_mutex)) != 0) {
+    perror("pthread_mutex_destroy failed\n");
     return -1;
   }
 
   // de-allocate heap memory
-  if (file->head_ptr) {
-    zc_access_info *ptr = file->head_ptr;
-    zc_access_info *next;
-    while (ptr->next) {
-      next = ptr->next;
-      free(ptr);
-      ptr = next;
-    }
-    free(file->head_ptr);
-  } 
-
-  if (file->buffer_mutexes) {
-    free(file->buffer_mutexes);
-    file->buffer_mutexes = NULL;
-  }
-
-
-  if (file->num_readers) {
-    free(file->num_readers);
-    file->num_readers = NULL;
-  }
-
-
   free(file);
   file = NULL;
 
@@ -186,72 +190,41 @@ int zc_close(zc_file *file) {
 
 const char *zc_read_start(zc_file *file, size_t *size) {
 
-  while (1) {
-
-    IF_TRUE_THEN_FAILED_TO_READ(wait_try_to_access_buffer_mutex(file) != 0, 
-      "wait_try_to_access_buffer_mutex failed\n");
-
-    int num_pages = calc_num_pages(file);
-    int *locked_mutexes = malloc(num_pages * sizeof(int));
-    IF_TRUE_THEN_FAILED_TO_READ(locked_mutexes == NULL, "malloc failed\n");
-    for (int i=0; i < num_pages; i++) {
-      locked_mutexes[i] = 0;
-    }
-    int able_to_get_mutexes = 1;
-    int start_index, end_index;
-    set_start_and_end_index(file, size, &start_index, &end_index);
-
-    // for each of the pages that we need to read
-    IF_TRUE_THEN_FAILED_TO_READ(try_to_get_mutexes(file, start_index, end_index, locked_mutexes, &able_to_get_mutexes, READ) != 0, 
-      "wait_try_to_get_mutexes failed\n");
-
-    // if we are able to get all mutexes
-    if (able_to_get_mutexes) {
-
-      // update number of readers count
-      IF_TRUE_THEN_FAILED_TO_READ(update_num_readers(file, start_index, end_index, INCREASE_COUNT) != 0, 
-        "update_num_readers failed\n");
-
-      // add zc_access_info entry
-      IF_TRUE_THEN_FAILED_TO_READ(add_access_info_entry(file, start_index, end_index) != 0, 
-        "add_access_info_entry failed\n");
+  IF_TRUE_THEN_FAILED_TO_READ(lock_range_mutex(file) != 0, "lock_range_mutex failed\n");
 
-    // if there exists a mutex that we could not get
-    } else {
+  // wait until no write holds any of the pages that we need to read,
+  // the offset may have moved by the time we are woken up
+  zc_range_waiter waiter;
+  int start_index, end_index;
+  while (1) {
 
-      // unlock all other mutexes that this thread has locked
-      IF_TRUE_THEN_FAILED_TO_READ(unlock_mutexes(file, start_index, end_index, locked_mutexes) != 0, 
-        "unlock_mutexes failed\n");
+    // invalid offset
+    if (file->offset < 0 || file->offset >= file->size) {
+      unlock_range_mutex(file);
+      IF_TRUE_THEN_FAILED_TO_READ(1, "invalid offset\n");
     }
 
-    IF_TRUE_THEN_FAILED_TO_READ(post_try_to_access_buffer_mutex(file) != 0, 
-      "post_try_to_access_buffer_mutex failed\n");
-
-    
-    free(locked_mutexes);
-    locked_mutexes = NULL;
-    
-    
-
-    if (able_to_get_mutexes) {
-      // break out of while loop
+    set_start_and_end_index(file, size, &start_index, &end_index);
+    if (is_range_free(file, start_index, end_index, READ)) {
       break;
-    } else {
-      // sleep for 1 second to let other threads go first
-      sleep(1);
     }
-
+    if (wait_for_range(file, &waiter, start_index, end_index) != 0) {
+      unlock_range_mutex(file);
+      IF_TRUE_THEN_FAILED_TO_READ(1, "wait_for_range failed\n");
+    }
   }
 
-  // invalid offset
-  IF_TRUE_THEN_FAILED_TO_READ((file->offset < 0 || file->offset >= file->size), 
-    "invalid offset\n");
+  // add zc_access_info entry
+  if (add_access_info_entry(file, start_index, end_index, READ) != 0) {
+    unlock_range_mutex(file);
+    IF_TRUE_THEN_FAILED_TO_READ(1, "add_access_info_entry failed\n");
+  }
 
-  int old_offset = file->offset;
-  int capacity = file->size - file->offset;
+  long old_offset = file->offset;
+  long capacity = file->size - file->offset;
 
   // if size of file >= *size bytes remaining
-  if (capacity >= (int) *size) {
+  if (capacity >= (long) *size) {
 
     // update offset
     file->offset += *size;
@@ -262,41 +235,31 @@ const char *zc_read_start(zc_file *file, size_t *size) {
     *size = (size_t) capacity;
 
     // update offset
-    file->offset += capacity; 
+    file->offset += capacity;
   }
 
+  IF_TRUE_THEN_FAILED_TO_READ(unlock_range_mutex(file) != 0, "unlock_range_mutex failed\n");
+
   // return pointer
-  return file->ptr + old_offset;  
+  return file->ptr + old_offset;
 
 }
 
 void zc_read_end(zc_file *file) {
 
-  IF_TRUE_THEN_EXIT_ONE(wait_try_to_access_buffer_mutex(file) != 0, 
-    "wait_try_to_access_buffer_mutex failed\n");
+  IF_TRUE_THEN_EXIT_ONE(lock_range_mutex(file) != 0, "lock_range_mutex failed\n");
 
   // get the access_infro_entry
   zc_access_info *ptr = remove_access_info_entry(file);
 
   IF_TRUE_THEN_EXIT_ONE(ptr == NULL, "get_access_info_entry failed\n");
 
-  int start_index = ptr->start_index;
-  int end_index = ptr->end_index;
-  if (ptr) {
-    free(ptr);
-    ptr = NULL;
-  }
+  // let the threads waiting for these pages check them again
+  IF_TRUE_THEN_EXIT_ONE(wake_range_waiters(file, ptr->start_index, ptr->end_index) != 0,
+    "wake_range_waiters failed\n");
+
+  IF_TRUE_THEN_EXIT_ONE(unlock_range_mutex(file) != 0, "unlock_range_mutex failed\n");
 
-  for (int i = start_index; i <= end_index; i++) {
-    file->num_readers[i]--;
-    
-    if (file->num_readers[i] == 0) {
-      IF_TRUE_THEN_EXIT_ONE(sem_post(&(file->buffer_mutexes[i])) != 0, "sem_post failed\n");
-    }
-  }
-  IF_TRUE_THEN_EXIT_ONE(post_try_to_access_buffer_mutex(file) != 0, 
-    "post_try_to_access_buffer_mutex failed\n");
-  
 }
 
 /**************
@@ -305,99 +268,70 @@ void zc_read_end(zc_file *file) {
 
 char *zc_write_start(zc_file *file, size_t size) {
 
-  while (1) {
+  IF_TRUE_THEN_FAILED_TO_WRITE(lock_range_mutex(file) != 0, "lock_range_mutex failed\n");
 
-    IF_TRUE_THEN_FAILED_TO_WRITE(wait_try_to_access_buffer_mutex(file) != 0, 
-      "wait_try_to_access_buffer_mutex failed\n");
-  
+  // wait until no other thread holds any of the pages that we need to write
+  zc_range_waiter waiter;
+  int start_index, end_index;
+  while (1) {
 
-    int num_pages = calc_num_pages(file);
-    int able_to_get_mutexes = 1;
-    int *locked_mutexes = calloc(num_pages, sizeof(int));
-    IF_TRUE_THEN_FAILED_TO_WRITE(locked_mutexes == NULL, "malloc failed\n");
-    for (int i=0; i < num_pages; i++) {
-        locked_mutexes[i] = 0;
-    }
-    if (locked_mutexes == NULL) {
+    // invalid offset
+    if (file->offset < 0) {
+      unlock_range_mutex(file);
       return NULL;
     }
 
-    if (file->size == 0) {
-
-      IF_TRUE_THEN_FAILED_TO_WRITE(add_access_info_entry(file, 0, -1) != 0, 
-          "add_access_info_entry failed\n");
-    } else {
-
-      // take min(file->offset, file->size) as start offset
-      long start_offset = (file->offset <= file->size) ? file->offset : file->size;
-      int start_index = get_index(start_offset);
-
-      long end_offset = (file->offset + size < file->size) ? file->offset + size -1: file->size -1;
-      int end_index = get_index(end_offset);
-
-      // for each of the pages that we need to write
-      IF_TRUE_THEN_FAILED_TO_WRITE(try_to_get_mutexes(file, start_index, end_index, locked_mutexes, &able_to_get_mutexes, WRITE) != 0, 
-        "wait_try_to_get_mutexes failed\n");
-
-      // if we are not able to get all mutexes
-      if (able_to_get_mutexes) {
-        IF_TRUE_THEN_FAILED_TO_WRITE(add_access_info_entry(file, start_index, end_index) != 0, 
-          "add_access_info_entry failed\n");
-
-      } else {
-        // unlock all other mutexes that this thread has locked
-        IF_TRUE_THEN_FAILED_TO_WRITE(unlock_mutexes(file, start_index, end_index, locked_mutexes) != 0, 
-          "unlock_mutexes failed\n");
-      }
-    }
-    
-
-    IF_TRUE_THEN_FAILED_TO_WRITE(post_try_to_access_buffer_mutex(file) != 0, 
-      "post_try_to_access_buffer_mutex failed\n");
-
-    free(locked_mutexes);
-
-    if (able_to_get_mutexes) {
-      // break out of while loop
+    set_write_start_and_end_index(file, size, &start_index, &end_index);
+    if (is_range_free(file, start_index, end_index, WRITE)) {
       break;
-    } else {
-      // sleep for 1 second to let other threads go first
-      sleep(1);
+    }
+    if (wait_for_range(file, &waiter, start_index, end_index) != 0) {
+      unlock_range_mutex(file);
+      IF_TRUE_THEN_FAILED_TO_WRITE(1, "wait_for_range failed\n");
     }
   }
 
-  // invalid offset
-  if (file->offset < 0) {
-    return NULL;
+  if (add_access_info_entry(file, start_index, end_index, WRITE) != 0) {
+    unlock_range_mutex(file);
+    IF_TRUE_THEN_FAILED_TO_WRITE(1, "add_access_info_entry failed\n");
   }
 
+  // the file is resized while holding range_mutex, so that no other
+  // thread looks at its size or mapping halfway through
+
   // check if offset is beyond size of file
   // if it is, fill gap with '\0' characters
   if (file->offset > file->size) {
 
-    IF_TRUE_THEN_FAILED_TO_WRITE(update_file_size(file, file->offset, 1) != 0, 
-      "update_file_size failed\n");
+    if (update_file_size(file, file->offset, 1) != 0) {
+      unlock_range_mutex(file);
+      IF_TRUE_THEN_FAILED_TO_WRITE(1, "update_file_size failed\n");
+    }
   }
 
 
-  int old_offset = file->offset;
-  int capacity = file->size - file->offset;
+  long old_offset = file->offset;
+  long capacity = file->size - file->offset;
 
   // if file not mapped to virtual address yet OR
   // if size of mapped memory < size, we need to:
   // (1) increase size of file
   // (2) update mapping in virtual memory
-  if (file->ptr == NULL || capacity < (int) size) {
+  if (file->ptr == NULL || capacity < (long) size) {
     // update size
-    int new_size = file->size + size - capacity;
+    long new_size = file->size + size - capacity;
 
-    IF_TRUE_THEN_FAILED_TO_WRITE(update_file_size(file, new_size, 0) != 0, 
-      "update_file_size failed\n");
+    if (update_file_size(file, new_size, 0) != 0) {
+      unlock_range_mutex(file);
+      IF_TRUE_THEN_FAILED_TO_WRITE(1, "update_file_size failed\n");
+    }
   }
 
   // update offset
   file->offset += size;
 
+  IF_TRUE_THEN_FAILED_TO_WRITE(unlock_range_mutex(file) != 0, "unlock_range_mutex failed\n");
+
   // return pointer to original offset
   return file->ptr + old_offset;
 
@@ -405,34 +339,37 @@ char *zc_write_start(zc_file *file, size_t size) {
 
 void zc_write_end(zc_file *file) {
 
-  IF_TRUE_THEN_EXIT_ONE(wait_try_to_access_buffer_mutex(file) != 0, 
-      "wait_try_to_access_buffer_mutex failed\n");
-
-
-  zc_access_info *ptr = remove_access_info_entry(file);
+  IF_TRUE_THEN_EXIT_ONE(lock_range_mutex(file) != 0, "lock_range_mutex failed\n");
+  zc_access_info *ptr = get_access_info_entry(file);
   IF_TRUE_THEN_EXIT_ONE(ptr == NULL, "get_access_info_entry failed\n");
 
+  // only the written pages that exist need flushing
   int start_index = ptr->start_index;
   int end_index = ptr->end_index;
-  free(ptr);
-  
-  // flush updates into file
-  if (msync(file->ptr+(start_index * sysconf(_SC_PAGESIZE)), (end_index - start_index + 1) * sysconf(_SC_PAGESIZE), MS_SYNC) != 0) {
+  int num_pages = calc_num_pages(file);
+  if (end_index > num_pages - 1) {
+    end_index = num_pages - 1;
+  }
+  void *start_ptr = file->ptr + (start_index * sysconf(_SC_PAGESIZE));
+  IF_TRUE_THEN_EXIT_ONE(unlock_range_mutex(file) != 0, "unlock_range_mutex failed\n");
+
+  // flush updates into file, without blocking other threads. The mapping
+  // does not move meanwhile, as only a write that outgrows the reserved
+  // address space moves it, and that write locks every page
+  if (end_index >= start_index && msync(start_ptr, (end_index - start_index + 1) * sysconf(_SC_PAGESIZE), MS_SYNC) != 0) {
     perror("mysnc failed\n");
     exit(1);
   }
 
-  for (int i = start_index; i <= end_index; i++) {
-
-    if (sem_post(&(file->buffer_mutexes[i])) != 0) {
+  IF_TRUE_THEN_EXIT_ONE(lock_range_mutex(file) != 0, "lock_range_mutex failed\n");
+  ptr = remove_access_info_entry(file);
+  IF_TRUE_THEN_EXIT_ONE(ptr == NULL, "get_access_info_entry failed\n");
 
-      perror("sem_post failed\n");
-      exit(1);
-    }
-  }
+  // let the threads waiting for these pages check them again
+  IF_TRUE_THEN_EXIT_ONE(wake_range_waiters(file, ptr->start_index, ptr->end_index) != 0,
+    "wake_range_waiters failed\n");
 
-  IF_TRUE_THEN_EXIT_ONE(post_try_to_access_buffer_mutex(file) != 0, 
-      "post_try_to_access_buffer_mutex failed\n");
+  IF_TRUE_THEN_EXIT_ONE(unlock_range_mutex(file) != 0, "unlock_range_mutex failed\n");
 
 }
 
@@ -442,32 +379,35 @@ void zc_write_end(zc_file *file) {
 
 off_t zc_lseek(zc_file *file, long offset, int whence) {
 
-  IF_TRUE_THEN_FAILED_TO_LSEEK(wait_try_to_access_buffer_mutex(file) != 0, 
-    "sem_wait failed\n");
+  IF_TRUE_THEN_FAILED_TO_LSEEK(lock_range_mutex(file) != 0,
+    "lock_range_mutex failed\n");
 
   off_t retval;
   switch (whence) {
     case SEEK_SET:
-      retval = (int) offset;
+      retval = offset;
       break;
     case SEEK_CUR:
-      retval = file->offset + (int) offset;
+      retval = file->offset + offset;
       break;
     case SEEK_END:
-      retval = file->size + (int) offset;
+      retval = file->size + offset;
       break;
     default:
       retval = (off_t) -1;
   }
 
-  IF_TRUE_THEN_FAILED_TO_LSEEK((retval < 0), "lseek retval < 0\n");
+  if (retval < 0) {
+    unlock_range_mutex(file);
+    IF_TRUE_THEN_FAILED_TO_LSEEK(1, "lseek retval < 0\n");
+  }
 
   if (retval != (off_t) - 1) {
     file->offset = retval;
   }
 
-  IF_TRUE_THEN_FAILED_TO_LSEEK(post_try_to_access_buffer_mutex(file) != 0, 
-    "sem_post failed\n");
+  IF_TRUE_THEN_FAILED_TO_LSEEK(unlock_range_mutex(file) != 0,
+    "unlock_range_mutex failed\n");
 
   return retval;
 }
@@ -508,21 +448,10 @@ int zc_copyfile(const char *source, const char *dest) {
   }
 
   if (source_zc_file->size < dest_zc_file->size) {
-    long old_size = dest_zc_file->size;
-    long new_size = source_zc_file->size;
-    // increase size of file
-    if (ftruncate(dest_zc_file->fd, new_size) != 0) {
-      return -1;
-    }
-    if (update_ptr_to_virtual_address(dest_zc_file, new_size) != 0) {
+    // decrease size of file
+    if (update_file_size(dest_zc_file, source_zc_file->size, 0) != 0) {
       return -1;
     }
-    dest_zc_file->size = new_size;
-
-    if (update_sync_resources(dest_zc_file, old_size) != 0) {
-      return -1;
-    }
-
   }
 
   // get write pointer to dest file
@@ -556,28 +485,52 @@ int zc_copyfile(const char *source, const char *dest) {
 }
 
 
+// maps the file up to new_size bytes. The mapping grows in place into
+// the reserved address space, and only moves to a larger reservation
+// when it outgrows it. It never shrinks, the caller does not touch the
+// pages beyond the end of the file
 int update_ptr_to_virtual_address(zc_file *file, long new_size) {
-  // if new_size is 0, then don't map into virtual memory
-  if (new_size == 0) {
-    file->ptr = NULL;  
-  }
-  else if (file->ptr != NULL) {
-    // remap memory
-    file->ptr = mremap(file->ptr, file->size, new_size, MREMAP_MAYMOVE);
-    if (file->ptr == MAP_FAILED) {
-      perror("mremap failed\n");
-      return -1;
-    }
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  long new_mapped = (new_size + page_size - 1) / page_size * page_size;
+  if (new_mapped <= file->mapped) {
+    return 0;
   }
-  else {
-    // map memory
-    file->ptr = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE, file->fd, 0);
-    if (file->ptr == MAP_FAILED) {
+
+  if (new_mapped <= file->reserved) {
+    // map the new pages right after the old ones
+    void *ptr = mmap(file->ptr + file->mapped, new_mapped - file->mapped, PROT_READ | PROT_WRITE,
+      MAP_SHARED_VALIDATE | MAP_FIXED, file->fd, file->mapped);
+    if (ptr == MAP_FAILED) {
       perror("mmap failed\n");
       return -1;
     }
+    file->mapped = new_mapped;
+    return 0;
   }
-  
+
+  // reserve address space for the file to grow into
+  long reserved = 2 * new_mapped > MIN_RESERVED_SIZE ? 2 * new_mapped : MIN_RESERVED_SIZE;
+  void *ptr = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ptr == MAP_FAILED) {
+    perror("mmap failed\n");
+    return -1;
+  }
+
+  // map memory at its start, then drop the old mapping
+  if (mmap(ptr, new_mapped, PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE | MAP_FIXED, file->fd, 0) == MAP_FAILED) {
+    perror("mmap failed\n");
+    munmap(ptr, reserved);
+    return -1;
+  }
+  if (file->ptr != NULL && munmap(file->ptr, file->reserved) != 0) {
+    perror("munmap failed\n");
+    return -1;
+  }
+  file->ptr = ptr;
+  file->reserved = reserved;
+  file->mapped = new_mapped;
+
   return 0;
 }
 
@@ -591,43 +544,11 @@ long get_file_size(zc_file *file) {
 }
 
 int init_sync_resources(zc_file *file) {
-  int num_pages = calc_num_pages(file);
-
-  if (sem_init(&(file->try_to_access_buffer_mutex), 0, 1) != 0) {
-    perror("sem_init failed\n");
-    return -1;
-  }
-  
-
-  if (num_pages == 0) {
-
-    file->buffer_mutexes = NULL;
-    file->num_readers = NULL;
-    return 0;
-  }
-
-  file->buffer_mutexes = malloc(sizeof(sem_t) * num_pages);
-
-  if (file->buffer_mutexes == NULL) {
-    perror("malloc failed\n");
-    return -1;
-  }
 
-  for (int i = 0; i < num_pages; i++) {
-    if (sem_init(&(file->buffer_mutexes[i]), 0, 1) != 0) {
-      perror("sem_init failed\n");
-      return -1;
-    }
-  }
-  
-  file->num_readers = malloc(sizeof(int) * num_pages);
-  if (file->num_readers == NULL) {
-    perror("malloc failed\n");
+  if (pthread_mutex_init(&(file->range_mutex), NULL) != 0) {
+    perror("pthread_mutex_init failed\n");
     return -1;
   }
-  for (int i = 0; i < num_pages; i++) {
-    file->num_readers[i] = 0;
-  }
 
   return 0;
 
@@ -646,237 +567,168 @@ int get_index(long num) {
   return (int) (num / sysconf(_SC_PAGESIZE));
 }
 
-int add_access_info_entry(zc_file *file, int start_index, int end_index) {
+int add_access_info_entry(zc_file *file, int start_index, int end_index, mode mode) {
 
-  // create new entry
-  zc_access_info *new_ptr = (zc_access_info *) malloc(sizeof(zc_access_info));
+  // take an unused entry of this thread
+  zc_access_info *new_ptr = get_access_info_entry(NULL);
   if (new_ptr == NULL) {
-    perror("malloc failed\n");
+    perror("thread holds too many ranges\n");
     return -1;
   }
-  new_ptr->next = NULL;
-  new_ptr->thread_id = gettid();
+  new_ptr->file = file;
   new_ptr->start_index = start_index;
   new_ptr->end_index = end_index;
+  new_ptr->mode = mode;
 
-  // get last entry
-  zc_access_info *ptr = file->head_ptr;
-  if (ptr) {
-    while (ptr->next) {
-      ptr = ptr->next;
-    }
-
-    ptr->next = new_ptr;
+  // insert at the head of the list
+  new_ptr->prev = NULL;
+  new_ptr->next = file->head_ptr;
+  if (file->head_ptr) {
+    file->head_ptr->prev = new_ptr;
   }
-  else {
-    file->head_ptr = new_ptr;
+  file->head_ptr = new_ptr;
+  if (mode == WRITE) {
+    file->num_writes++;
   }
   return 0;
 }
 
-int update_num_readers(zc_file *file, int start_index, int end_index, update_readers_mode mode) {
-  switch (mode) {
-    case INIT_COUNT:
-      for (int i=start_index; i <= end_index; i++) {
-        file->num_readers[i] = 0;
-      }
-      return 0;
-    case INCREASE_COUNT:
-      for (int i=start_index; i <= end_index; i++) {
-        file->num_readers[i]++;
-      }
-      return 0;
-    case DECREASE_COUNT:
-      for (int i=start_index; i <= end_index; i++) {
-        file->num_readers[i]--;
-      }
-      return 0;
-    default:
-      perror("unexpected mode for update_num_readers\n");
-      return -1;
-  }
-}
+int lock_range_mutex(zc_file *file) {
 
-int unlock_mutexes(zc_file *file, int start_index, int end_index, int *locked_mutexes) {
-  for (int i = start_index; i <= end_index; i++) {
-    if (locked_mutexes[i]) {
-      if (sem_post(&(file->buffer_mutexes[i])) != 0) {
-        return -1;
-      }
-    }
-  }
-  return 0;
-}
-
-int wait_try_to_access_buffer_mutex(zc_file *file) {
-
-  if (sem_wait(&(file->try_to_access_buffer_mutex)) != 0) {
-    perror("sem_wait failed\n");
+  if (pthread_mutex_lock(&(file->range_mutex)) != 0) {
+    perror("pthread_mutex_lock failed\n");
     return -1;
   }
 
   return 0;
 }
 
-int try_to_get_mutexes(zc_file *file, int start_index, int end_index, int *locked_mutexes, int *able_to_get_mutexes, mode mode) {
-  for (int i = start_index; i <= end_index; i++) {
-    if ((mode == READ && file->num_readers[i] == 0) || (mode == WRITE)) {
-      if (sem_trywait(&(file->buffer_mutexes[i])) == 0) {
-        // record mutexes that this read has locked
-        locked_mutexes[i] = 1; 
-      } else {
-
-        if (errno == EAGAIN) {
-          // one of the mutex that's needed is already locked
-          *able_to_get_mutexes = 0;
-          break;
-        }
-        else {
-          return -1;
-        }
-        
-      }
-    }
-  }
-  return 0;
-}
-
+int unlock_range_mutex(zc_file *file) {
 
-int post_try_to_access_buffer_mutex(zc_file *file) {
-
-  if (sem_post(&(file->try_to_access_buffer_mutex)) != 0) {
-    perror("sem_post failed\n");
+  if (pthread_mutex_unlock(&(file->range_mutex)) != 0) {
+    perror("pthread_mutex_unlock failed\n");
     return -1;
   }
   return 0;
 
 }
 
-void set_start_and_end_index(zc_file *file, size_t* size, int *start_index, int *end_index) {
-  *start_index = get_index(file->offset);
-  long new_offset = ((file->size - file->offset) >= (long) *size) ? (long) (file->offset + *size) : (long) file->size;
-  *end_index = get_index(new_offset-1);
-}
-
-zc_access_info *remove_access_info_entry(zc_file *file) {
-  pid_t target_thread_id = gettid();
-  zc_access_info *ptr = file->head_ptr;
-
-  if (ptr == NULL) {
-    perror("file->head_ptr should not be empty\n");
-    exit(1);
+// checks whether pages start_index to end_index can be locked for mode,
+// reads only conflict with writes while writes conflict with everything
+int is_range_free(zc_file *file, int start_index, int end_index, mode mode) {
+  // nothing to look through if only reads are held and we read
+  if (mode == READ && file->num_writes == 0) {
+    return 1;
   }
-  zc_access_info *prev = NULL;
-
-  while (ptr) {
-    if (ptr->thread_id == target_thread_id) {
-      break;
-    }
-    else {
-      prev = ptr;
-      ptr = ptr->next;
+  for (zc_access_info *ptr = file->head_ptr; ptr; ptr = ptr->next) {
+    if (ptr->start_index <= end_index && start_index <= ptr->end_index &&
+        (mode == WRITE || ptr->mode == WRITE)) {
+      return 0;
     }
   }
-
-  if (prev) {
-    prev->next = ptr->next;
-  } else {
-    file->head_ptr = ptr->next;
-  }
-
-  return ptr;
+  return 1;
 }
 
-int update_sync_resources(zc_file *file, long size) {
+// sleeps until a range overlapping pages start_index to end_index is
+// unlocked, the caller must hold range_mutex and check the pages again
+int wait_for_range(zc_file *file, zc_range_waiter *waiter, int start_index, int end_index) {
 
-  int new_num_pages = calc_num_pages(file);
-  int num_pages = 0;
-
-  if (size % sysconf(_SC_PAGESIZE) == 0) {
-    num_pages = (int) get_index(size);
-  } else {
-    num_pages = (int) get_index(size) + 1;
+  waiter->start_index = start_index;
+  waiter->end_index = end_index;
+  if (pthread_cond_init(&(waiter->cond), NULL) != 0) {
+    perror("pthread_cond_init failed\n");
+    return -1;
   }
+  waiter->next = file->waiters;
+  file->waiters = waiter;
 
+  int retval = pthread_cond_wait(&(waiter->cond), &(file->range_mutex));
 
-  if (new_num_pages > num_pages) {
-    // increase length of buffer_mutexes array
-
-    file->buffer_mutexes = realloc(file->buffer_mutexes, new_num_pages * sizeof(sem_t));
+  // remove waiter from the list
+  zc_range_waiter **prev = &(file->waiters);
+  while (*prev != waiter) {
+    prev = &((*prev)->next);
+  }
+  *prev = waiter->next;
+  pthread_cond_destroy(&(waiter->cond));
 
-    if (file->buffer_mutexes == NULL) {
-      return -1;
-    }
-    // increase length of num_readers array
-    file->num_readers = realloc(file->num_readers, new_num_pages * sizeof(int));
-    if (file->num_readers == NULL) {
-      return -1;
-    }
+  return retval == 0 ? 0 : -1;
+}
 
-    for (int i = num_pages; i < new_num_pages; i++) {
-      // initialize new mutexes
-      if (sem_init(&(file->buffer_mutexes[i]), 0, 0) != 0) {
+// wakes the threads waiting for any of pages start_index to end_index,
+// the caller must hold range_mutex
+int wake_range_waiters(zc_file *file, int start_index, int end_index) {
+  for (zc_range_waiter *waiter = file->waiters; waiter; waiter = waiter->next) {
+    if (waiter->start_index <= end_index && start_index <= waiter->end_index) {
+      if (pthread_cond_signal(&(waiter->cond)) != 0) {
+        perror("pthread_cond_signal failed\n");
         return -1;
       }
-
-      // initialize new counters
-      file->num_readers[i] = 0;
     }
-
-
   }
-  else if (new_num_pages < num_pages) {
-
+  return 0;
+}
 
-    for (int i = new_num_pages; i < num_pages; i++) {
+void set_start_and_end_index(zc_file *file, size_t* size, int *start_index, int *end_index) {
+  *start_index = get_index(file->offset);
+  long new_offset = ((file->size - file->offset) >= (long) *size) ? (long) (file->offset + *size) : (long) file->size;
+  *end_index = get_index(new_offset-1);
+}
 
-      if (sem_destroy(&(file->buffer_mutexes[i])) != 0) {
-        return -1;
-      }
-      file->num_readers[i] = 0;
-    }
+void set_write_start_and_end_index(zc_file *file, size_t size, int *start_index, int *end_index) {
+  // take min(file->offset, file->size) as start offset
+  long start_offset = (file->offset <= file->size) ? file->offset : file->size;
+  *start_index = get_index(start_offset);
 
-    // decrease length of buffer_mutexes array
-    file->buffer_mutexes = realloc(file->buffer_mutexes, new_num_pages * sizeof(sem_t));
+  // a write that grows the file also holds every page after the end,
+  // so that only one thread at a time resizes the file
+  if (file->offset + (long) size > file->size) {
+    *end_index = INT_MAX;
+  } else {
+    *end_index = get_index(file->offset + size - 1);
+  }
 
-    if (file->buffer_mutexes == NULL) {
-      return -1;
-    }
+  // a write that outgrows the reserved address space moves the mapping,
+  // so it holds every page: no other thread may use a pointer into it
+  if (file->offset + (long) size > file->reserved) {
+    *start_index = 0;
+  }
+}
 
-    // decrease length of num_readers array
-    file->num_readers = realloc(file->num_readers, new_num_pages* sizeof(int));
-    if (file->num_readers == NULL) {
-      return -1;
+// gets the entry of the calling thread for file, or an unused entry if
+// file is NULL, by looking through the few entries of this thread only
+zc_access_info *get_access_info_entry(zc_file *file) {
+  for (int i = 0; i < MAX_RANGES_PER_THREAD; i++) {
+    if (thread_access_infos[i].file == file) {
+      return &(thread_access_infos[i]);
     }
-
-
   }
-
-  return 0;
+  return NULL;
 }
 
-
-int update_access_info_entry(zc_file *file, int end_index) {
-  pid_t target_thread_id = gettid();
-  zc_access_info *ptr = file->head_ptr;
-
+zc_access_info *remove_access_info_entry(zc_file *file) {
+  zc_access_info *ptr = get_access_info_entry(file);
   if (ptr == NULL) {
-    perror("file->head_ptr should not be empty\n");
-    exit(1);
+    return NULL;
   }
 
-  while (ptr) {
-    if (ptr->thread_id == target_thread_id) {
-      break;
-    }
-    else {
-      ptr = ptr->next;
-    }
+  // unlink the entry, its neighbours are known so no search is needed
+  if (ptr->prev) {
+    ptr->prev->next = ptr->next;
+  } else {
+    file->head_ptr = ptr->next;
+  }
+  if (ptr->next) {
+    ptr->next->prev = ptr->prev;
   }
 
-  ptr->end_index = end_index;
+  if (ptr->mode == WRITE) {
+    file->num_writes--;
+  }
 
-  return 0;
+  // the entry stays readable until this thread locks another range
+  ptr->file = NULL;
+  return ptr;
 }
 
 int update_file_size(zc_file *file, long new_size, int fill_with_null) {
@@ -898,15 +750,6 @@ int update_file_size(zc_file *file, long new_size, int fill_with_null) {
     memset(file->ptr+old_size, 0, file->offset-old_size);
   }
 
-  if (update_sync_resources(file, old_size) != 0) {
-    return -1;
-  }
-
-  int end_index = get_index(new_size);
-  if (update_access_info_entry(file, end_index) != 0) {
-    return -1;
-  } 
-
   return 0;
 }
 
@@ -1,37 +1,122 @@
 #include <errno.h>
 #include <fcntl.h>
-#include <semaphore.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "zc_io.h"
 
+// bytes that a copy thread takes at a time
+#define COPY_WINDOW_SIZE (16L << 20)
+// bytes of a window that are resident at a time when copying through
+// mappings
+#define COPY_STEP_SIZE (1L << 20)
+// most threads that copy a file
+#define COPY_MAX_THREADS 8
+
+// A copy of a file, split into windows that copy threads take in turn.
+typedef struct zc_copy zc_copy;
+struct zc_copy {
+  int source_fd;
+  int dest_fd;
+  long size;
+  // offset of the next window that no thread has taken
+  long next_offset;
+  // whether to copy through mappings, as the kernel cannot copy
+  int use_mmap;
+  // -1 once any window failed
+  int retval;
+};
+
 // The zc_file struct is analogous to the FILE struct that you get from fopen.
 struct zc_file {
   // pointer to the virtual memory space
   void *ptr;
   // offset from the start of the virtual memory
   long offset;
-  // total size of the file
+  // total size of the file, readers see this many bytes. Appenders move it
+  // atomically, but only once the file and the mapping hold their bytes,
+  // so it never passes length or capacity
   long size;
+  // end of the bytes reserved by appenders, at least size. Appenders move
+  // it atomically to claim their bytes
+  long tail;
+  // start of the first bytes that an appender gave back while later bytes
+  // were reserved, LONG_MAX if there are none. The end of file never
+  // passes it, and appends from it on fail until every byte from it up to
+  // tail is given back
+  long hole;
+  // bytes from hole up to tail given back so far
+  long released;
+  // length of the file on disk, at least size. Outside of
+  // ZC_WRITEBACK_SYNC it grows geometrically, and zc_flush and zc_close
+  // trim it back to size. The background flusher leaves it as it is
+  long length;
+  // length of the mapping, at least size. Writes past it grow it
+  // geometrically, the pages past the end of the file are never touched
+  long capacity;
   // file descriptor to the opened file
   int fd;
-  // mutex for access to the memory space
-  sem_t buffer_mutex;
-  // mutex for modifying the number of readers
-  sem_t num_readers_mutex;
-  // number of readers
-  int num_readers;
+  // lock for access to the memory space, shared by readers and held
+  // alone by writers. Waiting writers go before new readers, so a
+  // stream of readers cannot starve them
+  pthread_rwlock_t lock;
+  // bytes written by the current writer, set in zc_write_start
+  long write_offset;
+  long write_size;
+  // bytes written since they were last flushed, empty if dirty_start
+  // >= dirty_end. Guarded by dirty_mutex
+  long dirty_start;
+  long dirty_end;
+  // bytes handed to MS_ASYNC msync since the last MS_SYNC one, which may
+  // not be on disk yet. Only MS_SYNC flushes empty it. Guarded by dirty_mutex
+  long queued_start;
+  long queued_end;
+  // bytes written since the last MS_ASYNC msync
+  long async_bytes;
+  pthread_mutex_t dirty_mutex;
+  // when written bytes are flushed, see zc_set_writeback
+  zc_writeback writeback;
+  long writeback_param;
+  // background flusher, which sleeps on flusher_cond with dirty_mutex
+  pthread_t flusher;
+  pthread_cond_t flusher_cond;
+  int has_flusher;
+  int stop_flusher;
 };
 
 // helper functions
-void update_ptr_to_virtual_address(zc_file *file, int new_size);
+void update_ptr_to_virtual_address(zc_file *file, long new_capacity);
+void reserve_capacity(zc_file *file, long new_size);
+void publish_size(zc_file *file, long new_size);
+void release_reserved(zc_file *file, long start, long end);
+void close_hole(zc_file *file);
+int grow_file(zc_file *file, long new_size);
+int start_write_at(zc_file *file, long offset, size_t size);
+int write_back(zc_file *file, long start, long end);
+long grow_length(long length, long new_size);
+int trim_length(zc_file *file);
+int copy_in_windows(int source_fd, int dest_fd, long size);
+void *run_copy_thread(void *arg);
+int copy_window_in_kernel(zc_copy *copy, long offset, long size);
+int copy_window_with_mmap(zc_copy *copy, long offset, long size);
+void add_dirty_range(zc_file *file, long start, long end);
+void extend_range(long *range_start, long *range_end, long start, long end);
+int msync_dirty_range(zc_file *file, int flags);
+int sync_dirty_range(zc_file *file);
+int msync_range(zc_file *file, long start, long end, int flags);
+void *run_flusher(void *arg);
+int stop_flusher(zc_file *file);
 
 /**************
  * Exercise 1 *
@@ -62,36 +147,65 @@ zc_file *zc_open(const char *path) {
     perror("fstat failed\n");
     return NULL;
   }
-  int size = statbuf.st_size;
+  long size = statbuf.st_size;
 
   // map file into virtual address space
   file_ptr->ptr = NULL;
+  file_ptr->capacity = 0;
   update_ptr_to_virtual_address(file_ptr, size);
+  file_ptr->size = size;
+  file_ptr->tail = size;
+  file_ptr->hole = LONG_MAX;
+  file_ptr->released = 0;
+  file_ptr->length = size;
 
   // initialise synchronization resources 
-  if (sem_init(&(file_ptr->buffer_mutex), 0, 1) != 0) {
-    perror("sem_init failed\n");
+  pthread_rwlockattr_t attr;
+  if (pthread_rwlockattr_init(&attr) != 0 ||
+      pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP) != 0 ||
+      pthread_rwlock_init(&(file_ptr->lock), &attr) != 0) {
+    perror("pthread_rwlock_init failed\n");
     return NULL;
-  } 
-  if (sem_init(&(file_ptr->num_readers_mutex), 0, 1) != 0) {
-    perror("sem_init failed\n");
+  }
+  pthread_rwlockattr_destroy(&attr);
+  if (pthread_mutex_init(&(file_ptr->dirty_mutex), NULL) != 0 ||
+      pthread_cond_init(&(file_ptr->flusher_cond), NULL) != 0) {
+    perror("pthread_mutex_init failed\n");
     return NULL;
   }
-  file_ptr->num_readers = 0;
+
+  // nothing is dirty yet, and every write is flushed as it ends
+  file_ptr->dirty_start = 0;
+  file_ptr->dirty_end = 0;
+  file_ptr->queued_start = 0;
+  file_ptr->queued_end = 0;
+  file_ptr->async_bytes = 0;
+  file_ptr->writeback = ZC_WRITEBACK_SYNC;
+  file_ptr->writeback_param = 0;
+  file_ptr->has_flusher = 0;
+  file_ptr->stop_flusher = 0;
 
   return file_ptr;
 }
 
 int zc_close(zc_file *file) {
-  
-  // flush updates into file
-  if (msync(file->ptr, file->size, MS_SYNC) != 0) {
-    perror("mysnc failed\n");
+
+  if (stop_flusher(file) != 0) {
+    return -1;
+  }
+
+  // flush updates into file, unless write-back is left to the kernel
+  if (file->writeback != ZC_WRITEBACK_NONE && msync_dirty_range(file, MS_SYNC) != 0) {
+    return -1;
+  }
+
+  // drop the room reserved on disk for more writes
+  if (trim_length(file) != 0) {
     return -1;
   }
 
-  // unmap file from memory
-  if (munmap(file->ptr, file->size) != 0) {
+  // unmap file from memory, including the room reserved for more writes
+  if (file->ptr != NULL && munmap(file->ptr, file->capacity) != 0) {
       perror("munmap failed\n");
       return -1;
   }
@@ -102,15 +216,13 @@ int zc_close(zc_file *file) {
    return -1;
   }
 
-  // destroy semaphores
-  if (sem_destroy(&(file->buffer_mutex)) != 0) {
-    perror("sem_destroy failed\n");
-    return -1;
-  } 
-  if (sem_destroy(&(file->num_readers_mutex)) != 0) {
-    perror("sem_destroy failed\n");
+  // destroy lock
+  if (pthread_rwlock_destroy(&(file->lock)) != 0) {
+    perror("pthread_rwlock_destroy failed\n");
     return -1;
   }
+  pthread_mutex_destroy(&(file->dirty_mutex));
+  pthread_cond_destroy(&(file->flusher_cond));
 
   // de-allocate heap memory
   free(file);
@@ -120,50 +232,34 @@ int zc_close(zc_file *file) {
 }
 
 const char *zc_read_start(zc_file *file, size_t *size) {
-  if (sem_wait(&(file->num_readers_mutex)) != 0) {
-    perror("sem_wait failed\n");
+  if (pthread_rwlock_rdlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_rdlock failed\n");
     *size = 0;
     return NULL;    
   }
-  if (file->num_readers == 0) {
-    if (sem_wait(&(file->buffer_mutex)) != 0) {
-      perror("sem_wait failed\n");
+
+  // readers hold the lock together, so each one claims its bytes by
+  // moving the offset past them atomically. Appenders may hold the lock
+  // too and move the end of file meanwhile
+  long old_offset = __atomic_load_n(&(file->offset), __ATOMIC_RELAXED);
+  long file_size = __atomic_load_n(&(file->size), __ATOMIC_RELAXED);
+  long read_size;
+  do {
+    // invalid offset, there is nothing to read so let go of the lock
+    if (old_offset < 0 || old_offset >= file_size) {
+      pthread_rwlock_unlock(&(file->lock));
       *size = 0;
       return NULL;    
     }
-  }
 
-  file->num_readers++;
+    // read at most up to the end of the file
+    long capacity = file_size - old_offset;
+    read_size = capacity >= (long) *size ? (long) *size : capacity;
+  } while (!__atomic_compare_exchange_n(&(file->offset), &old_offset, old_offset + read_size, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-  if (sem_post(&(file->num_readers_mutex)) != 0) {
-    perror("sem_post failed\n");
-    *size = 0;
-    return NULL;    
-  }
-
-
-  // invalid offset
-  if (file->offset < 0 || file->offset >= file->size) {
-    *size = 0;
-    return NULL;    
-  }
-
-  int old_offset = file->offset;
-  int capacity = file->size - file->offset;
-  
-  // if size of file >= *size bytes remaining
-  if (capacity >= (int) *size) {
-  
-    // update offset
-    file->offset += *size;
-  }
-  else {
-    // update value of *size
-    *size = (size_t) capacity;
-
-    // update offset
-    file->offset += capacity; 
-  }
+  // update value of *size
+  *size = (size_t) read_size;
 
   // return pointer
   return file->ptr + old_offset;  
@@ -171,25 +267,10 @@ const char *zc_read_start(zc_file *file, size_t *size) {
 }
 
 void zc_read_end(zc_file *file) {
-  if (sem_wait(&(file->num_readers_mutex)) != 0) {
-    perror("sem_wait failed\n");
-    exit(1);
-  }
-
-  file->num_readers--;
-
-  if (file->num_readers == 0) {
-    if (sem_post(&(file->buffer_mutex)) != 0) {
-      perror("sem_post failed\n");
-      exit(1);
-    }
-  }
-  
-  if (sem_post(&(file->num_readers_mutex)) != 0) {
-    perror("sem_post failed\n");
+  if (pthread_rwlock_unlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_unlock failed\n");
     exit(1);
   }
-  
 }
 
 /**************
@@ -198,52 +279,17 @@ void zc_read_end(zc_file *file) {
 
 char *zc_write_start(zc_file *file, size_t size) {
 
-  if (sem_wait(&(file->buffer_mutex)) != 0) {
-    perror("sem_wait failed\n");
+  if (pthread_rwlock_wrlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_wrlock failed\n");
     return NULL;
   }
 
-  // invalid offset
-  if (file->offset < 0) {
+  long old_offset = file->offset;
+  if (start_write_at(file, old_offset, size) != 0) {
+    pthread_rwlock_unlock(&(file->lock));
     return NULL;
   }
 
-  // check if offset is beyond size of file
-  // if it is, fill gap with '\0' characters
-  if (file->offset > file->size) {
-    int old_size = file->size;
-
-    // increase size of file
-    if (ftruncate(file->fd, file->offset) != 0) {
-      perror("ftruncate failed\n");
-      return NULL;
-    }
-
-    update_ptr_to_virtual_address(file, file->offset);
-    memset(file->ptr+old_size, 0, file->offset-old_size);
-
-  }
-  
-  int old_offset = file->offset;
-  int capacity = file->size - file->offset;
-  
-  // if file not mapped to virtual address yet OR
-  // if size of mapped memory < size, we need to:
-  // (1) increase size of file
-  // (2) update mapping in virtual memory
-  if (file->ptr == NULL || capacity < (int) size) {
-    // update size
-    int new_size = file->size + size - capacity;
-
-    // increase size of file
-    if (ftruncate(file->fd, new_size) != 0) {
-      perror("ftruncate failed\n");
-      return NULL;
-    }
-
-    update_ptr_to_virtual_address(file, new_size);
-  }
-
   // update offset
   file->offset += size;
 
@@ -254,14 +300,12 @@ char *zc_write_start(zc_file *file, size_t size) {
 
 void zc_write_end(zc_file *file) {
 
-  // flush updates into file
-  if (msync(file->ptr, file->size, MS_SYNC) != 0) {
-    perror("mysnc failed\n");
+  if (write_back(file, file->write_offset, file->write_offset + file->write_size) != 0) {
     exit(1);
   }
 
-  if (sem_post(&(file->buffer_mutex)) != 0) {
-    perror("sem_post failed\n");
+  if (pthread_rwlock_unlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_unlock failed\n");
     exit(1);
   }
 
@@ -273,27 +317,28 @@ void zc_write_end(zc_file *file) {
 
 off_t zc_lseek(zc_file *file, long offset, int whence) {
 
-  if (sem_wait(&(file->buffer_mutex)) != 0) {
-    perror("sem_post failed\n");
+  if (pthread_rwlock_wrlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_wrlock failed\n");
     return (off_t) -1;
   }
 
-  int retval;
+  off_t retval;
   switch (whence) {
     case SEEK_SET:
-      retval = (int) offset;
+      retval = offset;
       break;
     case SEEK_CUR:
-      retval = file->offset + (int) offset;
+      retval = file->offset + offset;
       break;
     case SEEK_END:
-      retval = file->size + (int) offset;
+      retval = file->size + offset;
       break;
     default:
       retval = (off_t) -1;
   }
 
   if (retval < 0) {
+    pthread_rwlock_unlock(&(file->lock));
     return (off_t) -1;
   }
 
@@ -301,8 +346,8 @@ off_t zc_lseek(zc_file *file, long offset, int whence) {
     file->offset = retval;
   }
 
-  if (sem_post(&(file->buffer_mutex)) != 0) {
-    perror("sem_post failed\n");
+  if (pthread_rwlock_unlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_unlock failed\n");
     return (off_t) -1;;
   }
 
@@ -310,88 +355,298 @@ off_t zc_lseek(zc_file *file, long offset, int whence) {
 }
 
 /**************
- * Exercise 5 *
+ * Positional *
  **************/
 
-int zc_copyfile(const char *source, const char *dest) {
+const char *zc_pread_start(zc_file *file, long offset, size_t *size) {
+  if (pthread_rwlock_rdlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_rdlock failed\n");
+    *size = 0;
+    return NULL;
+  }
 
+  // invalid offset, there is nothing to read so let go of the lock
+  long file_size = __atomic_load_n(&(file->size), __ATOMIC_RELAXED);
+  if (offset < 0 || offset >= file_size) {
+    pthread_rwlock_unlock(&(file->lock));
+    *size = 0;
+    return NULL;
+  }
 
-  // check that the 2 file names are not NULL
-  if (source == NULL || dest == NULL) {
-    return -1;
+  // read at most up to the end of the file
+  if (file_size - offset < (long) *size) {
+    *size = (size_t) (file_size - offset);
   }
 
-  // open source file
-  zc_file *source_zc_file = zc_open(source);
-  if (source_zc_file == NULL) {
+  return file->ptr + offset;
+}
+
+char *zc_pwrite_start(zc_file *file, long offset, size_t size) {
+
+  if (pthread_rwlock_wrlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_wrlock failed\n");
+    return NULL;
+  }
+
+  if (start_write_at(file, offset, size) != 0) {
+    pthread_rwlock_unlock(&(file->lock));
+    return NULL;
+  }
+
+  return file->ptr + offset;
+}
+
+/*************
+ * Writeback *
+ *************/
+
+int zc_set_writeback(zc_file *file, zc_writeback writeback, long param) {
+
+  if (writeback == ZC_WRITEBACK_BACKGROUND && param <= 0) {
     return -1;
   }
 
-  // open dest file
-  zc_file *dest_zc_file = zc_open(dest);
-  if (dest_zc_file == NULL) {
+  // the old flusher goes first, it may be waiting for the lock
+  if (stop_flusher(file) != 0) {
     return -1;
   }
 
-  // set read pointer to source file
-  // and check that expected read size is equals to actual read size
-  long read_size = source_zc_file->size;
-  const char *read_ptr = zc_read_start(source_zc_file, (size_t *) &read_size);
-  if (read_ptr == NULL) {
+  // no write may be ending while the setting changes
+  if (pthread_rwlock_wrlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_wrlock failed\n");
     return -1;
   }
+  file->writeback = writeback;
+  file->writeback_param = param;
 
-  if (read_size != source_zc_file->size) {
+  // every write from now on must leave the file at its size
+  if (writeback == ZC_WRITEBACK_SYNC && trim_length(file) != 0) {
+    pthread_rwlock_unlock(&(file->lock));
+    return -1;
+  }
+  if (pthread_rwlock_unlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_unlock failed\n");
     return -1;
   }
 
+  if (writeback == ZC_WRITEBACK_BACKGROUND) {
+    file->stop_flusher = 0;
+    if (pthread_create(&(file->flusher), NULL, run_flusher, file) != 0) {
+      perror("pthread_create failed\n");
+      return -1;
+    }
+    file->has_flusher = 1;
+  }
 
-  // re-size of dest file so that it has the same size as source file
-  if (ftruncate(dest_zc_file->fd, source_zc_file->size) != 0) {
-    perror("ftruncate failed\n");
+  return 0;
+}
+
+int zc_flush(zc_file *file) {
+
+  int retval = sync_dirty_range(file);
+
+  // appenders holding the lock as readers may be past the end of file,
+  // so it is only trimmed with the lock held alone
+  if (pthread_rwlock_wrlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_wrlock failed\n");
     return -1;
   }
-  update_ptr_to_virtual_address(dest_zc_file, source_zc_file->size);
 
-  // get write pointer to dest file
-  char *write_ptr = zc_write_start(dest_zc_file, source_zc_file->size);
-  if (write_ptr == NULL) {
+  if (trim_length(file) != 0) {
+    retval = -1;
+  }
+
+  if (pthread_rwlock_unlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_unlock failed\n");
     return -1;
   }
 
-  // copy content from source file to dest file
-  memcpy(write_ptr, read_ptr, source_zc_file->size);
+  return retval;
+}
+
+/**********
+ * Append *
+ **********/
+
+char *zc_append_reserve(zc_file *file, size_t size) {
+
+  // appenders share the lock, like readers, and each one claims its
+  // bytes by moving the end of the reserved bytes past them atomically
+  if (pthread_rwlock_rdlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_rdlock failed\n");
+    return NULL;
+  }
+  long start = __atomic_fetch_add(&(file->tail), (long) size, __ATOMIC_RELAXED);
+  long end = start + (long) size;
+
+  // bytes after a hole are not handed out, so that readers never see it
+  int is_past_hole = start >= __atomic_load_n(&(file->hole), __ATOMIC_RELAXED);
+
+  // the file and the mapping only grow with the lock held alone, as the
+  // mapping may move. Our bytes stay ours meanwhile, as the end of the
+  // reserved bytes is already past them
+  if (is_past_hole || end > file->length || end > file->capacity) {
+    if (pthread_rwlock_unlock(&(file->lock)) != 0 ||
+        pthread_rwlock_wrlock(&(file->lock)) != 0) {
+      perror("pthread_rwlock_wrlock failed\n");
+      release_reserved(file, start, end);
+      return NULL;
+    }
+    if (is_past_hole || grow_file(file, end) != 0) {
+      release_reserved(file, start, end);
+      close_hole(file);
+      pthread_rwlock_unlock(&(file->lock));
+      return NULL;
+    }
+    if (pthread_rwlock_unlock(&(file->lock)) != 0 ||
+        pthread_rwlock_rdlock(&(file->lock)) != 0) {
+      perror("pthread_rwlock_rdlock failed\n");
+      release_reserved(file, start, end);
+      return NULL;
+    }
+  }
+
+  // only now may readers see our bytes, as '\0' until they are committed
+  publish_size(file, end);
+
+  return file->ptr + start;
+}
+
+// gives back the bytes from start to end that an appender reserved but
+// did not get. They come off the end of the reserved bytes if nothing was
+// reserved after them, and leave a hole otherwise
+void release_reserved(zc_file *file, long start, long end) {
+  long old_tail = end;
+  if (__atomic_compare_exchange_n(&(file->tail), &old_tail, start, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    return;
+  }
+  long old_hole = __atomic_load_n(&(file->hole), __ATOMIC_RELAXED);
+  while (start < old_hole &&
+         !__atomic_compare_exchange_n(&(file->hole), &old_hole, start, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  __atomic_fetch_add(&(file->released), end - start, __ATOMIC_RELAXED);
+}
+
+// takes the hole off the end of the reserved bytes once every byte from
+// it on is given back, the caller must hold the lock as a writer
+void close_hole(zc_file *file) {
+  if (file->hole == LONG_MAX || file->tail - file->hole > file->released) {
+    return;
+  }
+  if (file->tail > file->hole) {
+    file->tail = file->hole;
+  }
+  file->hole = LONG_MAX;
+  file->released = 0;
+}
+
+// moves the end of file up to new_size, unless another appender already
+// moved it further, but never past a hole. The file and the mapping must
+// hold new_size bytes
+void publish_size(zc_file *file, long new_size) {
+  long hole = __atomic_load_n(&(file->hole), __ATOMIC_RELAXED);
+  if (new_size > hole) {
+    new_size = hole;
+  }
+  long old_size = __atomic_load_n(&(file->size), __ATOMIC_RELAXED);
+  while (old_size < new_size &&
+         !__atomic_compare_exchange_n(&(file->size), &old_size, new_size, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+void zc_append_commit(zc_file *file, const char *ptr, size_t size) {
+
+  long start = ptr - (const char *) file->ptr;
+  if (write_back(file, start, start + (long) size) != 0) {
+    exit(1);
+  }
+
+  if (pthread_rwlock_unlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_unlock failed\n");
+    exit(1);
+  }
+}
+
+/**************
+ * Exercise 5 *
+ **************/
 
-  // end read from from source file
-  zc_read_end(source_zc_file);
+int zc_copyfile(const char *source, const char *dest) {
 
-  // end write from dest file
-  zc_write_end(dest_zc_file);
+  // check that the 2 file names are not NULL
+  if (source == NULL || dest == NULL) {
+    return -1;
+  }
 
-  // close source file
-  if (zc_close(source_zc_file) != 0) {
-    perror("zc_close failed\n");
+  // open source file
+  int source_fd = open(source, O_RDONLY);
+  if (source_fd == -1) {
+    perror("open failed\n");
     return -1;
   }
 
-  // close dest file
-  if (zc_close(dest_zc_file) != 0) {
-    perror("zc_close failed\n");
+  // open dest file
+  int dest_fd = open(dest, O_CREAT | O_RDWR, S_IRWXU);
+  if (dest_fd == -1) {
+    perror("open failed\n");
+    close(source_fd);
     return -1;
   }
 
-  return 0;
+  // get size of source file
+  struct stat statbuf;
+  if (fstat(source_fd, &statbuf) != 0) {
+    perror("fstat failed\n");
+    close(source_fd);
+    close(dest_fd);
+    return -1;
+  }
+  long size = statbuf.st_size;
+
+  // re-size of dest file so that it has the same size as source file,
+  // a clone does not cut off a longer tail of dest by itself
+  if (ftruncate(dest_fd, size) != 0) {
+    perror("ftruncate failed\n");
+    close(source_fd);
+    close(dest_fd);
+    return -1;
+  }
+
+  // the bytes never pass through this process if we can help it:
+  // (1) share the blocks of source file, if the file system can
+  // (2) otherwise copy the file a window at a time over a few threads,
+  //     see copy_in_windows
+  int retval = 0;
+  if (ioctl(dest_fd, FICLONE, source_fd) != 0) {
+    retval = copy_in_windows(source_fd, dest_fd, size);
+  }
+
+  // flush updates into file
+  if (retval == 0 && fsync(dest_fd) != 0) {
+    perror("fsync failed\n");
+    retval = -1;
+  }
+
+  close(source_fd);
+  close(dest_fd);
+  return retval;
 }
 
 
-void update_ptr_to_virtual_address(zc_file *file, int new_size) {
-  // if new_size is 0, then don't map into virtual memory
-  if (new_size == 0) {
+void update_ptr_to_virtual_address(zc_file *file, long new_capacity) {
+  // if new_capacity is 0, then don't map into virtual memory
+  if (new_capacity == 0) {
+    if (file->ptr != NULL) {
+      munmap(file->ptr, file->capacity);
+    }
     file->ptr = NULL;  
   }
   else if (file->ptr != NULL) {
     // remap memory
-    file->ptr = mremap(file->ptr, file->size, new_size, MREMAP_MAYMOVE);
+    file->ptr = mremap(file->ptr, file->capacity, new_capacity, MREMAP_MAYMOVE);
     if (file->ptr == MAP_FAILED) {
       perror("mremap failed\n");
       exit(1);
@@ -399,12 +654,405 @@ void update_ptr_to_virtual_address(zc_file *file, int new_size) {
   }
   else {
     // map memory
-    file->ptr = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE, file->fd, 0);
+    file->ptr = mmap(NULL, new_capacity, PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE, file->fd, 0);
     if (file->ptr == MAP_FAILED) {
       perror("mmap failed\n");
       free(file);
       exit(1);
     }
   }
+  file->capacity = new_capacity;
+}
+
+// makes the mapping at least new_size bytes long. It grows to at least
+// twice its length, so that a file written by appending is only remapped
+// a logarithmic number of times
+void reserve_capacity(zc_file *file, long new_size) {
+  if (new_size <= file->capacity) {
+    return;
+  }
+
+  update_ptr_to_virtual_address(file, grow_length(file->capacity, new_size));
+}
+
+// gets the length to grow length to, so that it holds new_size bytes:
+// at least twice length, rounded up to a whole page
+long grow_length(long length, long new_size) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  long new_length = length * 2;
+  if (new_length < new_size) {
+    new_length = new_size;
+  }
+  return (new_length + page_size - 1) / page_size * page_size;
+}
+
+// cuts the file on disk back to size, the caller must hold the lock as a
+// writer
+int trim_length(zc_file *file) {
+  if (file->length != file->size) {
+    if (ftruncate(file->fd, file->size) != 0) {
+      perror("ftruncate failed\n");
+      return -1;
+    }
+    file->length = file->size;
+  }
+  return 0;
+}
+
+// readies size bytes at offset to be written, growing the file if it is too
+// short. The caller must hold the lock as a writer
+int start_write_at(zc_file *file, long offset, size_t size) {
+
+  // invalid offset
+  if (offset < 0) {
+    return -1;
+  }
+
+  long new_size = offset + (long) size;
+  if (new_size < file->size) {
+    new_size = file->size;
+  }
+
+  // make room for the write, if it goes past the end of file
+  if (grow_file(file, new_size) != 0) {
+    return -1;
+  }
+
+  // check if offset is beyond size of file
+  // if it is, fill gap with '\0' characters
+  if (offset > file->size) {
+    memset(file->ptr + file->size, 0, offset - file->size);
+  }
   file->size = new_size;
-}
\ No newline at end of file
+
+  // later appends go after these bytes, which also fill any hole
+  if (file->tail < new_size) {
+    file->tail = new_size;
+    file->hole = LONG_MAX;
+    file->released = 0;
+  }
+
+  // remember the bytes written, zc_write_end marks them dirty
+  file->write_offset = offset;
+  file->write_size = size;
+  return 0;
+}
+
+// makes the file and the mapping hold new_size bytes, the caller must hold
+// the lock as a writer
+int grow_file(zc_file *file, long new_size) {
+
+  // if the write goes past the end of file on disk, we need to increase
+  // size of file, exactly if every write must be on disk as it ends and
+  // geometrically otherwise
+  if (new_size > file->length) {
+    long new_length = file->writeback == ZC_WRITEBACK_SYNC ? new_size : grow_length(file->length, new_size);
+    if (ftruncate(file->fd, new_length) != 0) {
+      perror("ftruncate failed\n");
+      return -1;
+    }
+    file->length = new_length;
+  }
+
+  // make room in the mapping, which is rarely needed as it grows
+  // geometrically
+  reserve_capacity(file, new_size);
+  return 0;
+}
+
+// flushes bytes start to end as the writeback setting says, the caller
+// must hold the lock
+int write_back(zc_file *file, long start, long end) {
+  switch (file->writeback) {
+    case ZC_WRITEBACK_SYNC:
+      // flush only the pages that were written
+      return msync_range(file, start, end, MS_SYNC);
+    case ZC_WRITEBACK_ASYNC: {
+      // start write-back once enough bytes are written, without waiting.
+      // Each batch only queues the bytes written since the last one, and
+      // zc_flush still waits for the queued ones
+      add_dirty_range(file, start, end);
+      pthread_mutex_lock(&(file->dirty_mutex));
+      file->async_bytes += end - start;
+      int is_batch_full = file->async_bytes >= file->writeback_param;
+      if (is_batch_full) {
+        file->async_bytes = 0;
+      }
+      pthread_mutex_unlock(&(file->dirty_mutex));
+      return is_batch_full ? msync_dirty_range(file, MS_ASYNC) : 0;
+    }
+    default:
+      add_dirty_range(file, start, end);
+      return 0;
+  }
+}
+
+// adds bytes start to end to the dirty range, the caller must hold the
+// lock
+void add_dirty_range(zc_file *file, long start, long end) {
+  pthread_mutex_lock(&(file->dirty_mutex));
+  extend_range(&(file->dirty_start), &(file->dirty_end), start, end);
+  pthread_mutex_unlock(&(file->dirty_mutex));
+}
+
+// makes range_start to range_end also cover bytes start to end
+void extend_range(long *range_start, long *range_end, long start, long end) {
+  if (start >= end) {
+    return;
+  }
+  if (*range_start >= *range_end) {
+    *range_start = start;
+    *range_end = end;
+  } else {
+    *range_start = start < *range_start ? start : *range_start;
+    *range_end = end > *range_end ? end : *range_end;
+  }
+}
+
+// flushes the dirty range and empties it. An MS_SYNC flush also waits for
+// the bytes queued by earlier MS_ASYNC ones, an MS_ASYNC flush queues the
+// dirty bytes. The caller must hold the lock so that the mapping does not move
+int msync_dirty_range(zc_file *file, int flags) {
+  pthread_mutex_lock(&(file->dirty_mutex));
+  long start = file->dirty_start;
+  long end = file->dirty_end;
+  file->dirty_start = 0;
+  file->dirty_end = 0;
+  if (flags & MS_SYNC) {
+    extend_range(&start, &end, file->queued_start, file->queued_end);
+    file->queued_start = 0;
+    file->queued_end = 0;
+  }
+  pthread_mutex_unlock(&(file->dirty_mutex));
+
+  if (start >= end) {
+    return 0;
+  }
+  if (msync_range(file, start, end, flags) != 0) {
+    // keep the bytes dirty, so a later flush tries again
+    add_dirty_range(file, start, end);
+    return -1;
+  }
+  if (flags & MS_ASYNC) {
+    pthread_mutex_lock(&(file->dirty_mutex));
+    extend_range(&(file->queued_start), &(file->queued_end), start, end);
+    pthread_mutex_unlock(&(file->dirty_mutex));
+  }
+  return 0;
+}
+
+// flushes the pages holding bytes start to end of the file
+int msync_range(zc_file *file, long start, long end, int flags) {
+  // the file may have shrunk since the bytes were written
+  if (end > file->size) {
+    end = file->size;
+  }
+  if (file->ptr == NULL || start >= end) {
+    return 0;
+  }
+
+  // msync takes a page aligned address
+  long page_start = start - start % sysconf(_SC_PAGESIZE);
+  if (msync(file->ptr + page_start, end - page_start, flags) != 0) {
+    perror("mysnc failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+// flushes the dirty range every writeback_param milliseconds until
+// stop_flusher is set
+// writes the dirty range back and waits for it, holding the lock as a
+// reader only, so readers and appenders go on meanwhile
+int sync_dirty_range(zc_file *file) {
+
+  // keep writers from moving the mapping while it is flushed
+  if (pthread_rwlock_rdlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_rdlock failed\n");
+    return -1;
+  }
+
+  int retval = msync_dirty_range(file, MS_SYNC);
+
+  if (pthread_rwlock_unlock(&(file->lock)) != 0) {
+    perror("pthread_rwlock_unlock failed\n");
+    return -1;
+  }
+
+  return retval;
+}
+
+// flushes the file every writeback_param ms without trimming it, as that
+// would stall every reader and appender and undo the geometric growth
+void *run_flusher(void *arg) {
+  zc_file *file = (zc_file *) arg;
+
+  pthread_mutex_lock(&(file->dirty_mutex));
+  while (!file->stop_flusher) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += file->writeback_param / 1000;
+    deadline.tv_nsec += (file->writeback_param % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&(file->flusher_cond), &(file->dirty_mutex), &deadline);
+    if (file->stop_flusher) {
+      break;
+    }
+
+    // the lock is taken before dirty_mutex, everywhere
+    pthread_mutex_unlock(&(file->dirty_mutex));
+    sync_dirty_range(file);
+    pthread_mutex_lock(&(file->dirty_mutex));
+  }
+  pthread_mutex_unlock(&(file->dirty_mutex));
+
+  return NULL;
+}
+
+// stops the background flusher if there is one
+int stop_flusher(zc_file *file) {
+  if (!file->has_flusher) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&(file->dirty_mutex));
+  file->stop_flusher = 1;
+  pthread_cond_signal(&(file->flusher_cond));
+  pthread_mutex_unlock(&(file->dirty_mutex));
+
+  if (pthread_join(file->flusher, NULL) != 0) {
+    perror("pthread_join failed\n");
+    return -1;
+  }
+  file->has_flusher = 0;
+  return 0;
+}
+
+// copies size bytes from source_fd to dest_fd in windows of
+// COPY_WINDOW_SIZE bytes, spread over up to COPY_MAX_THREADS threads. The
+// first window tells whether the kernel can copy between the two files,
+// page cache to page cache. If it cannot, every window is copied through
+// mappings of its own instead
+int copy_in_windows(int source_fd, int dest_fd, long size) {
+  zc_copy copy = {source_fd, dest_fd, size, 0, 0, 0};
+
+  long first_size = size < COPY_WINDOW_SIZE ? size : COPY_WINDOW_SIZE;
+  int retval = copy_window_in_kernel(&copy, 0, first_size);
+  if (retval == 1) {
+    copy.use_mmap = 1;
+    retval = copy_window_with_mmap(&copy, 0, first_size);
+  }
+  if (retval != 0) {
+    return -1;
+  }
+  copy.next_offset = first_size;
+
+  // one thread per window left, as far as there are processors for them
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  long num_windows = (size - first_size + COPY_WINDOW_SIZE - 1) / COPY_WINDOW_SIZE;
+  if (num_threads > COPY_MAX_THREADS) {
+    num_threads = COPY_MAX_THREADS;
+  }
+  if (num_threads > num_windows) {
+    num_threads = num_windows;
+  }
+
+  // this thread copies too, so it starts one thread less
+  pthread_t threads[COPY_MAX_THREADS];
+  int num_started = 0;
+  while (num_started < num_threads - 1 &&
+         pthread_create(&threads[num_started], NULL, run_copy_thread, &copy) == 0) {
+    num_started++;
+  }
+  run_copy_thread(&copy);
+  for (int i = 0; i < num_started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  return copy.retval;
+}
+
+// copies the windows of copy that no thread has taken yet, until there
+// are none or a window fails
+void *run_copy_thread(void *arg) {
+  zc_copy *copy = (zc_copy *) arg;
+
+  while (__atomic_load_n(&(copy->retval), __ATOMIC_RELAXED) == 0) {
+    long offset = __atomic_fetch_add(&(copy->next_offset), COPY_WINDOW_SIZE, __ATOMIC_RELAXED);
+    if (offset >= copy->size) {
+      break;
+    }
+    long size = copy->size - offset < COPY_WINDOW_SIZE ? copy->size - offset : COPY_WINDOW_SIZE;
+
+    int retval = copy->use_mmap ? copy_window_with_mmap(copy, offset, size)
+                                : copy_window_in_kernel(copy, offset, size);
+    if (retval != 0) {
+      __atomic_store_n(&(copy->retval), -1, __ATOMIC_RELAXED);
+    }
+  }
+
+  return NULL;
+}
+
+// copies size bytes at offset with copy_file_range. If the kernel cannot
+// copy between the two files, return 1 with nothing copied
+int copy_window_in_kernel(zc_copy *copy, long offset, long size) {
+  loff_t source_offset = offset;
+  loff_t dest_offset = offset;
+  while (source_offset < offset + size) {
+    ssize_t num_copied = copy_file_range(copy->source_fd, &source_offset, copy->dest_fd, &dest_offset,
+                                         offset + size - source_offset, 0);
+    if (num_copied == -1 && source_offset == offset &&
+        (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+      return 1;
+    }
+    if (num_copied == -1 && errno == EINTR) {
+      continue;
+    }
+    if (num_copied <= 0) {
+      perror("copy_file_range failed\n");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// copies size bytes at offset through mappings of just those bytes. Each
+// COPY_STEP_SIZE bytes are dropped from the mappings once copied, so that
+// little of the window is resident at a time
+int copy_window_with_mmap(zc_copy *copy, long offset, long size) {
+  char *source_ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, copy->source_fd, offset);
+  if (source_ptr == MAP_FAILED) {
+    perror("mmap failed\n");
+    return -1;
+  }
+  char *dest_ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, copy->dest_fd, offset);
+  if (dest_ptr == MAP_FAILED) {
+    perror("mmap failed\n");
+    munmap(source_ptr, size);
+    return -1;
+  }
+
+  // the window is read once, front to back
+  madvise(source_ptr, size, MADV_SEQUENTIAL);
+  madvise(dest_ptr, size, MADV_SEQUENTIAL);
+
+  for (long step = 0; step < size; step += COPY_STEP_SIZE) {
+    long step_size = size - step < COPY_STEP_SIZE ? size - step : COPY_STEP_SIZE;
+
+    // copy content from source file to dest file
+    memcpy(dest_ptr + step, source_ptr + step, step_size);
+
+    // the pages stay in the page cache, dirty ones included, as the
+    // mappings are shared
+    madvise(source_ptr + step, step_size, MADV_DONTNEED);
+    madvise(dest_ptr + step, step_size, MADV_DONTNEED);
+  }
+
+  munmap(source_ptr, size);
+  munmap(dest_ptr, size);
+  return 0;
+}
@@ -29,4 +29,40 @@ off_t zc_lseek(zc_file *file, long offset, int whence);
 // Exercise 5
 int zc_copyfile(const char *source, const char *dest);
 
+// Positional
+// Like zc_read_start and zc_write_start, but at offset, leaving the offset
+// of the file as it is. End them with zc_read_end and zc_write_end.
+const char *zc_pread_start(zc_file *file, long offset, size_t *size);
+char *zc_pwrite_start(zc_file *file, long offset, size_t size);
+
+// Writeback
+// When zc_write_end flushes the bytes written to the file. Bytes that are
+// not flushed yet are flushed by zc_flush, and by zc_close unless the
+// setting is ZC_WRITEBACK_NONE.
+typedef enum {
+  // msync the written pages with MS_SYNC in every zc_write_end (default)
+  ZC_WRITEBACK_SYNC,
+  // leave write-back to the kernel, even in zc_close
+  ZC_WRITEBACK_NONE,
+  // msync with MS_ASYNC once param bytes are dirty
+  ZC_WRITEBACK_ASYNC,
+  // msync with MS_SYNC from a background thread every param milliseconds
+  ZC_WRITEBACK_BACKGROUND,
+  // msync with MS_SYNC only in zc_flush and zc_close
+  ZC_WRITEBACK_EXPLICIT,
+} zc_writeback;
+
+int zc_set_writeback(zc_file *file, zc_writeback writeback, long param);
+int zc_flush(zc_file *file);
+
+// Append
+// Reserves size bytes at the end of the file, without moving the offset,
+// and holds them until zc_append_commit. Threads append concurrently, with
+// each other and with readers, and commit in any order. The end of file
+// moves past reserved bytes once the file holds them, so readers never
+// see bytes past the file on disk, but may see reserved bytes as '\0'
+// until they are committed.
+char *zc_append_reserve(zc_file *file, size_t size);
+void zc_append_commit(zc_file *file, const char *ptr, size_t size);
+
 #endif